@@ -0,0 +1,46 @@
+#!/bin/sh
+# generates the benchmark document root: small, medium and large files and a directory tree.
+# the content is derived from a fixed seed so every run serves the same bytes
+# usage: corpus.sh <directory>
+set -e
+root=${1:-bench/corpus}
+[ -f "$root/.complete" ] && exit 0
+rm -rf "$root"
+mkdir -p "$root/small" "$root/medium" "$root/large" "$root/tree"
+
+# writes size bytes of seeded pseudo random text to a file
+fill() {
+    awk -v size="$2" -v seed="$3" 'BEGIN {
+        srand(seed)
+        line = ""
+        for (i = 0; i < 64; i++)
+            line = line sprintf("%c", 97 + int(rand() * 26))
+        for (written = 0; written + 65 <= size; written += 65)
+            print line
+        printf "%s", substr(line, 1, size - written)
+    }' > "$1"
+}
+
+# pages a browser would fetch, a few KB each
+for i in $(seq 0 99); do
+    fill "$root/small/file-$i.html" $((1024 + i * 40)) $i
+done
+# images
+for i in $(seq 0 9); do
+    fill "$root/medium/file-$i.jpg" 262144 $((100 + i))
+done
+# downloads, large enough that sending them dominates
+for i in 0 1; do
+    fill "$root/large/file-$i.mp4" 16777216 $((200 + i))
+done
+# a listing of a thousand entries, and nested directories served through their index file
+for i in $(seq 0 999); do
+    : > "$root/tree/entry-$i.txt"
+done
+for i in $(seq 0 9); do
+    for j in $(seq 0 9); do
+        mkdir -p "$root/tree/d$i/d$j"
+        fill "$root/tree/d$i/d$j/index.html" 2048 $((300 + i * 10 + j))
+    done
+done
+touch "$root/.complete"
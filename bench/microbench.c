@@ -0,0 +1,83 @@
+//microbenchmarks of the helpers on every request's path: url decoding, request parsing, mime
+//lookup and the size formatting of directory listings. the server is compiled in with its
+//main renamed so the real functions are measured
+#define main myhttpd_main
+#include "../myhttpd.c"
+#undef main
+
+#define ITERATIONS 1000000
+
+const char *sampleRequest =
+    "GET /test/SampleVideo_1280x720_2mb.mp4 HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+//a plain path and one that is mostly escapes
+const char *urls[] = {"/test/SampleVideo_1280x720_2mb.mp4", "/My%20Documents/caf%C3%A9%20menu%2B%282024%29.html"};
+//a type in the table, the same in capitals and one that is not
+const char *extensions[] = {"html", "JPG", "xyz"};
+//sizes formatted in each unit a listing shows
+double sizes[] = {512, 48213, 7340032, 3221225472.0};
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *name, const char *input, double seconds)
+{
+    printf("%-12s %-50s %8.1f ns\n", name, input, seconds * 1e9 / ITERATIONS);
+}
+
+int main(void)
+{
+    HTTP_REQUEST req;
+    char buffer[BUFF_SIZE];
+    volatile long sink = 0;
+    double start;
+
+    initParser();
+    setMimeTypes(NULL);
+
+    for (int u = 0; u < (int)(sizeof(urls) / sizeof(urls[0])); u++)
+    {
+        start = now();
+        for (int i = 0; i < ITERATIONS; i++)
+            sink += decode(urls[u], buffer);
+        report("decode", urls[u], now() - start);
+    }
+
+    int len = strlen(sampleRequest);
+    start = now();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        memset(&req, 0, sizeof(req));
+        sink += parseRequest(&req, sampleRequest, len);
+    }
+    report("parse", "browser request", now() - start);
+
+    for (int e = 0; e < (int)(sizeof(extensions) / sizeof(extensions[0])); e++)
+    {
+        start = now();
+        for (int i = 0; i < ITERATIONS; i++)
+            sink += findMime(extensions[e]) != NULL;
+        report("findMime", extensions[e], now() - start);
+    }
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        start = now();
+        for (int i = 0; i < ITERATIONS; i++)
+            sink += readable_fs(sizes[s], buffer)[0];
+        sprintf(buffer, "%.0f bytes", sizes[s]);
+        report("readable_fs", buffer, now() - start);
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+//microbenchmark of the incremental request parser against the strtok tokeniser it replaced.
+//the server is compiled in with its main renamed so the real parser is measured
+#define main myhttpd_main
+#include "../myhttpd.c"
+#undef main
+
+#define ITERATIONS 1000000
+
+//a typical browser request and a minimal one
+const char *samples[] = {
+    "GET /test/SampleVideo_1280x720_2mb.mp4 HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n",
+    "GET /Hello.html HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "\r\n"};
+
+//the tokenising processrequest() used to do: copy the request, then strtok_r the request
+//line and the host line, which had to be the second one
+int parseStrtok(const char *request, char **method, char **resource, char **host)
+{
+    char buffer[BUFF_SIZE];
+    char *requestTokenSave, *statusTokenSave, *hostTokenSave;
+
+    strncpy(buffer, request, BUFF_SIZE - 1);
+    buffer[BUFF_SIZE - 1] = 0;
+    char *requestDuplicate = malloc(strlen(buffer) + 1);
+    strcpy(requestDuplicate, buffer);
+
+    char *requestToken = strtok_r(buffer, "\r\n", &requestTokenSave);
+    *method = strtok_r(requestToken, " ", &statusTokenSave);
+    requestToken = strtok_r(NULL, "\r\n", &requestTokenSave);
+    char *hostToken = strtok_r(requestToken, " ", &hostTokenSave);
+    int ok = hostToken != NULL && strcasecmp(hostToken, "HOST:") == 0;
+    if (ok)
+    {
+        *host = strtok_r(NULL, " ", &hostTokenSave);
+        *resource = strtok_r(NULL, " ", &statusTokenSave);
+    }
+    free(requestDuplicate);
+    return ok;
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+    HTTP_REQUEST req;
+    char *method, *resource, *host;
+    volatile int sink = 0;
+
+    initParser();
+    printf("scanner: %s\n", findByte == findByteScalar ? "scalar" :
+#if defined(__x86_64__) || defined(__i386__)
+                            findByte == findByteAvx2 ? "avx2" : "sse2"
+#else
+                            "scalar"
+#endif
+    );
+    for (int s = 0; s < (int)(sizeof(samples) / sizeof(samples[0])); s++)
+    {
+        int len = strlen(samples[s]);
+        double start = now();
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            sink += parseStrtok(samples[s], &method, &resource, &host);
+        }
+        double strtokTime = now() - start;
+
+        start = now();
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            memset(&req, 0, sizeof(req));
+            sink += parseRequest(&req, samples[s], len);
+        }
+        double parserTime = now() - start;
+
+        //the same request arriving in two reads
+        start = now();
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            memset(&req, 0, sizeof(req));
+            sink += parseRequest(&req, samples[s], len / 2);
+            sink += parseRequest(&req, samples[s], len);
+        }
+        double splitTime = now() - start;
+
+        printf("request %d (%d bytes): strtok %.1f ns, parser %.1f ns, parser over two reads %.1f ns\n",
+               s, len, strtokTime * 1e9 / ITERATIONS, parserTime * 1e9 / ITERATIONS, splitTime * 1e9 / ITERATIONS);
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+# drives every server build, serving mode and workload with the load generator on a loopback
+# port and writes the throughput and latency of each run to $REPORT.csv and $REPORT.json
+#
+# settings, all optional:
+#   VARIANTS     server builds as name:binary pairs          (plain:./myhttpd)
+#   MODES        serving modes as name:flags, flags split by commas
+#   WORKLOADS    workloads as name:url path
+#   DURATION     seconds per run (5), CONNECTIONS (32), THREADS (2)
+#   CORPUS       document root (bench/corpus), REPORT (bench/report)
+set -e
+VARIANTS=${VARIANTS:-plain:./myhttpd}
+MODES=${MODES:-prefork: epoll:-e uring:-u sharded:-e,-s pool:-t,4}
+WORKLOADS=${WORKLOADS:-small:/small/file-7.html medium:/medium/file-3.jpg large:/large/file-0.mp4 listing:/tree/ index:/tree/d4/d2/}
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-32}
+THREADS=${THREADS:-2}
+CORPUS=${CORPUS:-bench/corpus}
+REPORT=${REPORT:-bench/report}
+CLIENT=${CLIENT:-./myhttp}
+
+bench/corpus.sh "$CORPUS"
+corpus=$(cd "$CORPUS" && pwd)
+mimes=$(pwd)/mime.types
+log=$(mktemp)
+out=$(mktemp)
+
+echo "variant,mode,workload,requests,errors,requests_per_sec,mb_per_sec,p50_ms,p90_ms,p99_ms,p999_ms" > "$REPORT.csv"
+printf '[' > "$REPORT.json"
+separator=""
+runs=0
+
+for variant in $VARIANTS; do
+    server=${variant#*:}
+    for mode in $MODES; do
+        flags=$(echo "${mode#*:}" | tr ',' ' ')
+        # a fresh port per server, the last one's connections may still hold its port
+        runs=$((runs + 1))
+        port=$((20000 + ($$ + runs * 97) % 20000))
+        # the server daemonises, its pid is the id of the process group its workers share
+        "$server" -p $port -l "$log" -d "$corpus" -m "$mimes" $flags > "$out"
+        pid=$(sed -n 's/^Server pid = \([0-9]*\).*/\1/p' "$out")
+        sleep 1
+        for workload in $WORKLOADS; do
+            "$CLIENT" -b -k -c "$CONNECTIONS" -t "$THREADS" -d "$DURATION" "127.0.0.1:$port${workload#*:}" > "$out" 2>&1 || true
+            # Requests:    N (E errors, ...), Requests/s: R, Transfer/s: T MB and one line per percentile
+            set -- $(awk '
+                /^Requests:/   { requests = $2; errors = substr($3, 2) }
+                /^Requests\/s:/ { rate = $2 }
+                /^Transfer\/s:/ { mb = $2 }
+                $1 == "p50"    { p50 = $2 }
+                $1 == "p90"    { p90 = $2 }
+                $1 == "p99"    { p99 = $2 }
+                $1 == "p99.9"  { p999 = $2 }
+                END { printf "%s %s %s %s %s %s %s %s\n", requests + 0, errors + 0, rate + 0, mb + 0, p50 + 0, p90 + 0, p99 + 0, p999 + 0 }' "$out")
+            echo "${variant%%:*},${mode%%:*},${workload%%:*},$1,$2,$3,$4,$5,$6,$7,$8" >> "$REPORT.csv"
+            printf '%s\n  {"variant": "%s", "mode": "%s", "workload": "%s", "requests": %s, "errors": %s, "requests_per_sec": %s, "mb_per_sec": %s, "p50_ms": %s, "p90_ms": %s, "p99_ms": %s, "p999_ms": %s}' \
+                "$separator" "${variant%%:*}" "${mode%%:*}" "${workload%%:*}" "$1" "$2" "$3" "$4" "$5" "$6" "$7" "$8" >> "$REPORT.json"
+            separator=","
+            echo "${variant%%:*} ${mode%%:*} ${workload%%:*}: $3 requests/s, p99 $7 ms"
+        done
+        kill -TERM -"$pid" 2>/dev/null || true
+        sleep 1
+    done
+done
+printf '\n]\n' >> "$REPORT.json"
+rm -f "$log" "$out"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,14 +8,150 @@
 #include <sys/poll.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <limits.h>
 #define BUFF_SIZE 512
 #define DEFAULT_PORT 80
+//load generator defaults and limits
+#define DEFAULT_BENCH_CONNECTIONS 10
+#define DEFAULT_BENCH_THREADS 1
+#define DEFAULT_BENCH_DURATION 10
+#define MAX_BENCH_PIPELINE 64
+#define BENCH_BUFF_SIZE 16384
+//fetcher defaults: connections kept open to each host, and tries a url gets before it fails
+#define DEFAULT_FETCH_CONNECTIONS 4
+#define FETCH_ATTEMPTS 3
+//seconds without a byte from any connection before what is in flight is tried again
+#define FETCH_TIMEOUT 30
+#define MAX_URL_SIZE 200
+//latency histogram: values below 2^HIST_SUB_BITS ns get a bucket each, above that every power
+//of two is split into 2^HIST_SUB_BITS buckets, so a value is known to within 1%
+#define HIST_SUB_BITS 7
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+//latency histogram of one thread, merged into the first one for the report
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} HISTOGRAM;
+
+//a load generator connection, with requests sent but not yet answered in flight
+typedef struct
+{
+    int sock;
+    int inFlight;
+    //responses read on this connection
+    int answered;
+    //send times of the requests in flight, oldest first from sendHead
+    uint64_t sendTimes[MAX_BENCH_PIPELINE];
+    int sendHead;
+    //requests waiting for the socket
+    char out[BENCH_BUFF_SIZE];
+    int outLen;
+    int outOff;
+    //response being read: headers are gathered in buf, the body is only counted
+    char buf[BENCH_BUFF_SIZE];
+    int len;
+    int inBody;
+    long bodyLeft;
+    int untilClose;
+    int closeAfter;
+    int status;
+} BENCH_CONN;
+
+//a load generator thread and its share of the connections and results
+typedef struct
+{
+    pthread_t thread;
+    int numConns;
+    BENCH_CONN *conns;
+    int epfd;
+    HISTOGRAM hist;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t non2xx;
+    uint64_t bytes;
+} BENCH_THREAD;
+
+//a url to fetch and what became of it
+typedef struct
+{
+    char page[MAX_URL_SIZE];
+    int host;
+    int status;
+    long bytes;
+    int attempts;
+} FETCH_URL;
+
+struct FETCH_HOST;
+
+//a kept alive connection of a host's pool, with the urls requested on it oldest first
+typedef struct
+{
+    int sock;
+    struct FETCH_HOST *host;
+    int inFlight[MAX_BENCH_PIPELINE];
+    int flightHead;
+    int numInFlight;
+    //responses read on this connection
+    int answered;
+    char out[BENCH_BUFF_SIZE];
+    int outLen;
+    int outOff;
+    //response being read: headers are gathered in buf, the body is streamed to file
+    char buf[BENCH_BUFF_SIZE];
+    int len;
+    int inBody;
+    long bodyLeft;
+    int untilClose;
+    int closeAfter;
+    int file;
+} FETCH_CONN;
+
+//a host:port urls are fetched from. urls wait in a ring until a connection takes them, those
+//sent again after a connection is lost go back to the front
+typedef struct FETCH_HOST
+{
+    char name[MAX_URL_SIZE];
+    int port;
+    struct sockaddr_in addr;
+    int resolved;
+    int *pending;
+    int capacity;
+    int pendHead;
+    int numPending;
+    FETCH_CONN *conns;
+} FETCH_HOST;
 
 int get(int sockfd, char *resource);
 int trace(int sockfd, char *resource);
 int head(int sockfd, char *resource);
+int benchmark(struct sockaddr_in *addr, char *method, char *page, char *host, int port);
+int parseUrl(char *url, char *ip, int *port, char *page);
+int fetch(char **urls, int numUrls, char *method);
+char **readUrls(FILE *in, int *numUrls);
 
 int contentOnly = 1;
+//load generator settings
+int benchMode = 0;
+//connections, or connections per host when fetching, 0 for the default of the mode
+int benchConnections = 0;
+int benchThreads = DEFAULT_BENCH_THREADS;
+int benchDuration = 0;
+long benchRequests = 0;
+int benchKeepAlive = 0;
+int benchPipeline = 1;
+//fetcher settings: where bodies are written, NULL to only report them
+char *outputDir = NULL;
 //Set up socket for client  based on the Address family INET
 
 int main(int argc, char *argv[])
@@ -27,13 +164,12 @@ int main(int argc, char *argv[])
     struct hostent *server;
 
     char buffer[BUFF_SIZE];
-    int opt, index;
+    int opt;
     int numArgs = 0;
-    int succ_parsing = 0;
     char *url;
     char *method = "GET";
 
-    while ((opt = getopt(argc, argv, "m:a")) != -1)
+    while ((opt = getopt(argc, argv, "m:abc:t:d:n:kP:o:")) != -1)
     {
         switch (opt)
         {
@@ -43,59 +179,66 @@ int main(int argc, char *argv[])
         case 'a':
             contentOnly = 0;
             break;
+        case 'b':
+            benchMode = 1;
+            break;
+        case 'c':
+            benchConnections = atoi(optarg);
+            break;
+        case 't':
+            benchThreads = atoi(optarg);
+            break;
+        case 'd':
+            benchDuration = atoi(optarg);
+            break;
+        case 'n':
+            benchRequests = atol(optarg);
+            break;
+        case 'k':
+            benchKeepAlive = 1;
+            break;
+        case 'P':
+            benchPipeline = atoi(optarg);
+            break;
+        case 'o':
+            outputDir = optarg;
+            break;
         default:
             fprintf(stderr, "Usage: \n%s \t[ -m <method> ] Method to send\n\
                \t[ -a ] View response content only\n\
-               \t< url >\n",
+               \t[ -b ] Benchmark the url instead of fetching it\n\
+               \t[ -c <connections> ] Concurrent connections, per host when fetching several urls\n\
+               \t[ -t <threads> ] Threads the connections are spread over\n\
+               \t[ -d <seconds> ] How long to run for\n\
+               \t[ -n <requests> ] How many requests to send\n\
+               \t[ -k ] Keep connections alive between requests\n\
+               \t[ -P <depth> ] Requests pipelined on each kept alive connection\n\
+               \t[ -o <directory> ] Save the bodies of fetched urls under directory\n\
+               \t[ url ... ] Urls to fetch, read from stdin one per line if none are given\n",
                     argv[0]);
             exit(EXIT_FAILURE);
         }
     }
-    //make sure only one url provided 
-    for (index = optind; index < argc; index++)
+    //several urls, urls from stdin or saving to files go through the fetcher
+    numArgs = argc - optind;
+    if (benchMode && numArgs != 1)
     {
-        if (numArgs > 0)
-        {
-            fprintf(stderr, "Incorrect usage. Only supports one URL");
-            exit(EXIT_FAILURE);
-        }
-        numArgs++;
-
-        url = argv[index];
+        fprintf(stderr, "Incorrect usage. Only supports one URL when benchmarking\n");
+        exit(EXIT_FAILURE);
+    }
+    if (numArgs != 1 || outputDir != NULL)
+    {
+        char **urls = argv + optind;
+        if (numArgs == 0)
+            urls = readUrls(stdin, &numArgs);
+        return fetch(urls, numArgs, method);
     }
+    url = argv[optind];
 
-    //parse url
-    //copied from lines 53-56
-    //https://github.com/luismartingil/scripts/blob/master/c_parse_http_url/parse_http_uri.c
     char ip[200];
     int port = 80;
     char page[200] = "";
-    if (strstr(url, "http://") != NULL)
-    {
-        url += 7;
-    }
-    if (strstr(url, "https://") != NULL)
-    {
-        url += 8;
-    }
-    if (sscanf(url, "%99[^:]:%i/%199[^\n]", ip, &port, page) == 3)
-    {
-        succ_parsing = 1;
-    }
-    else if (sscanf(url, "%99[^/]/%199[^\n]", ip, page) == 2)
-    {
-        succ_parsing = 1;
-    }
-    else if (sscanf(url, "%99[^:]:%i[^\n]", ip, &port) == 2)
-    {
-        succ_parsing = 1;
-    }
-    else if (sscanf(url, "%99[^\n]", ip) == 1)
-    {
-        succ_parsing = 1;
-    }
-
-    if (!succ_parsing)
+    if (!parseUrl(url, ip, &port, page))
     {
         fprintf(stderr, "Error parsing url. Try host.com:port/resource\n");
         exit(1);
@@ -127,6 +270,12 @@ int main(int argc, char *argv[])
     // Assign server address to server port number
     serv_addr.sin_port = htons(portno);
 
+    if (benchMode)
+    {
+        close(sockfd);
+        return benchmark(&serv_addr, method, page, ip, port);
+    }
+
     // Client can connect to server
     if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
     {
@@ -210,3 +359,798 @@ int main(int argc, char *argv[])
 
     return 0;
 }
+
+//splits a url into host, port and page, without the leading slash. returns 0 if it cannot.
+//copied from lines 53-56
+//https://github.com/luismartingil/scripts/blob/master/c_parse_http_url/parse_http_uri.c
+int parseUrl(char *url, char *ip, int *port, char *page)
+{
+    if (strstr(url, "http://") != NULL)
+    {
+        url += 7;
+    }
+    if (strstr(url, "https://") != NULL)
+    {
+        url += 8;
+    }
+    if (sscanf(url, "%99[^:]:%i/%199[^\n]", ip, port, page) == 3)
+        return 1;
+    if (sscanf(url, "%99[^/]/%199[^\n]", ip, page) == 2)
+        return 1;
+    if (sscanf(url, "%99[^:]:%i[^\n]", ip, port) == 2)
+        return 1;
+    return sscanf(url, "%99[^\n]", ip) == 1;
+}
+//monotonic clock in nanoseconds
+uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+//bucket of a value. the bucket is the value itself while it fits the sub buckets, then the
+//power of two it falls in picks a block of sub buckets and its top bits the one in the block
+int histIndex(uint64_t value)
+{
+    if (value < (1 << HIST_SUB_BITS))
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (value >> shift) - (1 << HIST_SUB_BITS);
+}
+//lowest value that lands in a bucket
+uint64_t histValue(int index)
+{
+    if (index < (1 << HIST_SUB_BITS))
+        return index;
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)(index & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS)) << shift;
+}
+void histRecord(HISTOGRAM *hist, uint64_t value)
+{
+    hist->counts[histIndex(value)]++;
+    if (hist->total == 0 || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+    hist->total++;
+    hist->sum += value;
+}
+void histMerge(HISTOGRAM *into, HISTOGRAM *from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    if (from->total && (into->total == 0 || from->min < into->min))
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+    into->total += from->total;
+    into->sum += from->sum;
+}
+//value below which the given fraction of the recorded values fall
+uint64_t histPercentile(HISTOGRAM *hist, double fraction)
+{
+    uint64_t wanted = (uint64_t)(fraction * hist->total + 0.5), seen = 0;
+    if (wanted == 0)
+        wanted = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= wanted)
+            return histValue(i) < hist->max ? histValue(i) : hist->max;
+    }
+    return hist->max;
+}
+
+//shared by the load generator threads
+struct sockaddr_in *benchAddr;
+char benchRequest[BUFF_SIZE];
+int benchRequestLen;
+int benchHeadOnly;
+uint64_t benchDeadline;
+long benchIssued = 0;
+
+//claims the next request, false once the requested count has been sent
+int benchClaim(void)
+{
+    if (benchRequests <= 0)
+        return 1;
+    return __atomic_fetch_add(&benchIssued, 1, __ATOMIC_RELAXED) < benchRequests;
+}
+//writes out what requests the socket will take, waiting for it to drain if it will not take all
+int benchFlush(BENCH_CONN *conn)
+{
+    while (conn->outOff < conn->outLen)
+    {
+        int n = send(conn->sock, conn->out + conn->outOff, conn->outLen - conn->outOff, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        conn->outOff += n;
+    }
+    conn->outOff = conn->outLen = 0;
+    return 0;
+}
+//keeps the pipeline of a connection full
+int benchFill(BENCH_CONN *conn)
+{
+    while (conn->inFlight < benchPipeline && conn->outLen + benchRequestLen <= BENCH_BUFF_SIZE && benchClaim())
+    {
+        memcpy(conn->out + conn->outLen, benchRequest, benchRequestLen);
+        conn->outLen += benchRequestLen;
+        conn->sendTimes[(conn->sendHead + conn->inFlight) % MAX_BENCH_PIPELINE] = nowNs();
+        conn->inFlight++;
+    }
+    return benchFlush(conn);
+}
+//opens a connection and queues its first requests, they go out once it is connected. fails
+//without having claimed any requests
+int benchConnect(BENCH_THREAD *t, BENCH_CONN *conn)
+{
+    struct epoll_event ev;
+
+    memset(conn, 0, sizeof(*conn));
+    if ((conn->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    {
+        conn->sock = -1;
+        return -1;
+    }
+    if (connect(conn->sock, (struct sockaddr *)benchAddr, sizeof(*benchAddr)) < 0 && errno != EINPROGRESS)
+    {
+        close(conn->sock);
+        conn->sock = -1;
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->sock, &ev);
+    //a failure to send shows up as an error event on the socket
+    benchFill(conn);
+    return 0;
+}
+//drops a connection and opens a new one if there is more to send. what was in flight on it
+//counts as failed, unless the server has been answering on it. then it is taken to have
+//closed it on reaching its request limit and the requests are sent again
+void benchReconnect(BENCH_THREAD *t, BENCH_CONN *conn, int failed)
+{
+    if (failed && conn->answered == 0)
+        t->errors += conn->inFlight ? conn->inFlight : 1;
+    else if (benchRequests > 0)
+        __atomic_fetch_sub(&benchIssued, conn->inFlight, __ATOMIC_RELAXED);
+    close(conn->sock);
+    conn->sock = -1;
+    conn->inFlight = 0;
+    if (nowNs() < benchDeadline && (benchRequests <= 0 || __atomic_load_n(&benchIssued, __ATOMIC_RELAXED) < benchRequests))
+    {
+        if (benchConnect(t, conn) < 0)
+            t->errors++;
+    }
+}
+//finds the value of a response header in the headers gathered so far, or NULL
+char *benchHeader(BENCH_CONN *conn, int headerLen, const char *name)
+{
+    int nameLen = strlen(name);
+    for (char *line = memchr(conn->buf, '\n', headerLen); line != NULL && line < conn->buf + headerLen;
+         line = memchr(line + 1, '\n', conn->buf + headerLen - line - 1))
+    {
+        if (strncasecmp(line + 1, name, nameLen) == 0 && line[1 + nameLen] == ':')
+            return line + 2 + nameLen;
+    }
+    return NULL;
+}
+//a response has been read in full
+int benchComplete(BENCH_THREAD *t, BENCH_CONN *conn)
+{
+    histRecord(&t->hist, nowNs() - conn->sendTimes[conn->sendHead]);
+    conn->sendHead = (conn->sendHead + 1) % MAX_BENCH_PIPELINE;
+    conn->inFlight--;
+    conn->answered++;
+    conn->inBody = 0;
+    t->completed++;
+    if (conn->status < 200 || conn->status > 299)
+        t->non2xx++;
+    if (conn->closeAfter || !benchKeepAlive)
+    {
+        benchReconnect(t, conn, 0);
+        return 1;
+    }
+    if (nowNs() < benchDeadline && benchFill(conn) < 0)
+    {
+        benchReconnect(t, conn, 1);
+        return 1;
+    }
+    return 0;
+}
+//reads what has arrived on a connection, splitting it into responses
+void benchRead(BENCH_THREAD *t, BENCH_CONN *conn)
+{
+    while (1)
+    {
+        int n = read(conn->sock, conn->buf + conn->len, BENCH_BUFF_SIZE - conn->len);
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+        {
+            //a response that runs until the connection closes is done, anything else failed
+            if (conn->inBody && conn->untilClose)
+            {
+                conn->closeAfter = 1;
+                benchComplete(t, conn);
+            }
+            else
+            {
+                benchReconnect(t, conn, 1);
+            }
+            return;
+        }
+        t->bytes += n;
+        conn->len += n;
+        while (conn->len > 0)
+        {
+            if (!conn->inBody)
+            {
+                char *end = memmem(conn->buf, conn->len, "\r\n\r\n", 4);
+                if (end == NULL)
+                {
+                    if (conn->len == BENCH_BUFF_SIZE)
+                    {
+                        benchReconnect(t, conn, 1);
+                        return;
+                    }
+                    break;
+                }
+                int headerLen = end + 4 - conn->buf;
+                char *value;
+                conn->status = conn->len > 12 ? atoi(conn->buf + 9) : 0;
+                conn->inBody = 1;
+                conn->untilClose = 0;
+                conn->closeAfter = (value = benchHeader(conn, headerLen, "Connection")) != NULL && strncasecmp(value + strspn(value, " "), "close", 5) == 0;
+                if (benchHeadOnly || conn->status == 204 || conn->status == 304)
+                    conn->bodyLeft = 0;
+                else if ((value = benchHeader(conn, headerLen, "Content-Length")) != NULL)
+                    conn->bodyLeft = atol(value);
+                else
+                    conn->untilClose = 1;
+                conn->len -= headerLen;
+                memmove(conn->buf, conn->buf + headerLen, conn->len);
+            }
+            if (conn->untilClose)
+            {
+                conn->len = 0;
+                break;
+            }
+            long take = conn->bodyLeft < conn->len ? conn->bodyLeft : conn->len;
+            conn->bodyLeft -= take;
+            conn->len -= take;
+            memmove(conn->buf, conn->buf + take, conn->len);
+            if (conn->bodyLeft == 0 && benchComplete(t, conn))
+                return;
+        }
+    }
+}
+//runs a thread's connections until the time is up or every request has been answered
+void *benchThread(void *arg)
+{
+    BENCH_THREAD *t = arg;
+    struct epoll_event events[64];
+
+    t->epfd = epoll_create1(0);
+    for (int i = 0; i < t->numConns; i++)
+    {
+        if (benchConnect(t, &t->conns[i]) < 0)
+            t->errors++;
+    }
+    while (nowNs() < benchDeadline)
+    {
+        int busy = 0;
+        for (int i = 0; i < t->numConns; i++)
+            busy |= t->conns[i].sock != -1 && t->conns[i].inFlight > 0;
+        if (!busy)
+            break;
+
+        int n = epoll_wait(t->epfd, events, 64, 100);
+        for (int i = 0; i < n; i++)
+        {
+            BENCH_CONN *conn = events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && conn->outLen > 0 && benchFlush(conn) < 0)
+            {
+                benchReconnect(t, conn, 1);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                benchRead(t, conn);
+        }
+    }
+    for (int i = 0; i < t->numConns; i++)
+    {
+        if (t->conns[i].sock != -1)
+            close(t->conns[i].sock);
+    }
+    close(t->epfd);
+    return NULL;
+}
+//load generator: spreads the connections over the threads, runs them and reports the rate,
+//throughput and latency percentiles
+int benchmark(struct sockaddr_in *addr, char *method, char *page, char *host, int port)
+{
+    if (benchConnections < 1)
+        benchConnections = DEFAULT_BENCH_CONNECTIONS;
+    if (benchThreads < 1)
+        benchThreads = 1;
+    if (benchThreads > benchConnections)
+        benchThreads = benchConnections;
+    if (!benchKeepAlive || benchPipeline < 1)
+        benchPipeline = 1;
+    if (benchPipeline > MAX_BENCH_PIPELINE)
+        benchPipeline = MAX_BENCH_PIPELINE;
+    if (benchDuration <= 0 && benchRequests <= 0)
+        benchDuration = DEFAULT_BENCH_DURATION;
+
+    benchAddr = addr;
+    benchHeadOnly = strcasecmp(method, "head") == 0;
+    benchRequestLen = snprintf(benchRequest, BUFF_SIZE, "%s /%s HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n\r\n",
+                               method, page, host, port, benchKeepAlive ? "keep-alive" : "close");
+
+    fprintf(stdout, "Benchmarking %s /%s on %s:%d\n", method, page, host, port);
+    fprintf(stdout, "  %d connections over %d threads, %s", benchConnections, benchThreads, benchKeepAlive ? "keep-alive" : "connection per request");
+    if (benchPipeline > 1)
+        fprintf(stdout, ", pipeline depth %d", benchPipeline);
+    if (benchDuration > 0)
+        fprintf(stdout, ", for %d s", benchDuration);
+    if (benchRequests > 0)
+        fprintf(stdout, ", %ld requests", benchRequests);
+    fprintf(stdout, "\n");
+
+    BENCH_THREAD *threads = calloc(benchThreads, sizeof(BENCH_THREAD));
+    BENCH_CONN *conns = calloc(benchConnections, sizeof(BENCH_CONN));
+    if (threads == NULL || conns == NULL)
+    {
+        perror("Error - Cannot allocate connections");
+        return 1;
+    }
+    uint64_t start = nowNs();
+    benchDeadline = benchDuration > 0 ? start + (uint64_t)benchDuration * 1000000000 : UINT64_MAX;
+    for (int i = 0, first = 0; i < benchThreads; i++)
+    {
+        threads[i].numConns = benchConnections / benchThreads + (i < benchConnections % benchThreads);
+        threads[i].conns = conns + first;
+        first += threads[i].numConns;
+        pthread_create(&threads[i].thread, NULL, benchThread, &threads[i]);
+    }
+
+    uint64_t errors = 0, non2xx = 0, bytes = 0;
+    for (int i = 0; i < benchThreads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        if (i > 0)
+            histMerge(&threads[0].hist, &threads[i].hist);
+        errors += threads[i].errors;
+        non2xx += threads[i].non2xx;
+        bytes += threads[i].bytes;
+    }
+    double seconds = (nowNs() - start) / 1e9;
+    HISTOGRAM *hist = &threads[0].hist;
+
+    fprintf(stdout, "Requests:    %lu (%lu errors, %lu non-2xx)\n", (unsigned long)hist->total, (unsigned long)errors, (unsigned long)non2xx);
+    fprintf(stdout, "Duration:    %.2f s\n", seconds);
+    fprintf(stdout, "Requests/s:  %.1f\n", hist->total / seconds);
+    fprintf(stdout, "Transfer/s:  %.2f MB\n", bytes / seconds / 1e6);
+    if (hist->total > 0)
+    {
+        fprintf(stdout, "Latency:     min %.3f ms, mean %.3f ms, max %.3f ms\n", hist->min / 1e6, (double)hist->sum / hist->total / 1e6, hist->max / 1e6);
+        fprintf(stdout, "  p50        %.3f ms\n", histPercentile(hist, 0.5) / 1e6);
+        fprintf(stdout, "  p90        %.3f ms\n", histPercentile(hist, 0.9) / 1e6);
+        fprintf(stdout, "  p99        %.3f ms\n", histPercentile(hist, 0.99) / 1e6);
+        fprintf(stdout, "  p99.9      %.3f ms\n", histPercentile(hist, 0.999) / 1e6);
+    }
+    free(conns);
+    free(threads);
+    return errors > 0;
+}
+
+//shared by the fetcher's functions
+FETCH_URL *fetchUrls;
+int fetchLeft;
+int fetchFailed;
+int fetchEpfd;
+char *fetchMethod;
+int fetchHeadOnly;
+
+//reads urls one per line, skipping blank lines
+char **readUrls(FILE *in, int *numUrls)
+{
+    char line[BUFF_SIZE];
+    char **urls = NULL;
+    int count = 0, cap = 0;
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0)
+            continue;
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            urls = realloc(urls, cap * sizeof(char *));
+        }
+        urls[count++] = strdup(line);
+    }
+    *numUrls = count;
+    return urls;
+}
+//a url is done with, one way or the other. one line is reported for each
+void fetchDone(FETCH_URL *u, FETCH_HOST *host, int failed)
+{
+    if (failed)
+    {
+        fetchFailed++;
+        fprintf(stdout, "ERR %s:%d/%s\n", host->name, host->port, u->page);
+    }
+    else
+    {
+        fprintf(stdout, "%d %ld %s:%d/%s\n", u->status, u->bytes, host->name, host->port, u->page);
+    }
+    fetchLeft--;
+}
+//creates the file a body is saved in, under the output directory at the url's path, with
+//the directories leading to it. a path naming a directory is saved as its index.html
+int fetchFile(FETCH_HOST *host, FETCH_URL *u)
+{
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/%s_%d/%s", outputDir, host->name, host->port, u->page);
+
+    path[strcspn(path, "?#")] = 0;
+    if (strstr(u->page, "..") != NULL || len >= (int)sizeof(path) - 11)
+        return -1;
+    len = strlen(path);
+    if (path[len - 1] == '/')
+        strcat(path, "index.html");
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = 0;
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+//writes out what requests the socket will take
+int fetchFlush(FETCH_CONN *conn)
+{
+    while (conn->outOff < conn->outLen)
+    {
+        int n = send(conn->sock, conn->out + conn->outOff, conn->outLen - conn->outOff, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        conn->outOff += n;
+    }
+    conn->outOff = conn->outLen = 0;
+    return 0;
+}
+//hands the host's waiting urls to a connection until its pipeline is full
+int fetchFill(FETCH_CONN *conn)
+{
+    FETCH_HOST *host = conn->host;
+    char request[BUFF_SIZE];
+
+    while (conn->numInFlight < benchPipeline && host->numPending > 0)
+    {
+        int i = host->pending[host->pendHead];
+        int len = snprintf(request, sizeof(request), "%s /%s HTTP/1.1\r\nHost: %s:%d\r\nConnection: keep-alive\r\n\r\n",
+                           fetchMethod, fetchUrls[i].page, host->name, host->port);
+        if (conn->outLen + len > BENCH_BUFF_SIZE)
+            break;
+        memcpy(conn->out + conn->outLen, request, len);
+        conn->outLen += len;
+        host->pendHead = (host->pendHead + 1) % host->capacity;
+        host->numPending--;
+        conn->inFlight[(conn->flightHead + conn->numInFlight) % MAX_BENCH_PIPELINE] = i;
+        conn->numInFlight++;
+    }
+    return fetchFlush(conn);
+}
+//opens a pooled connection and sends its first requests once connected
+void fetchConnect(FETCH_CONN *conn)
+{
+    struct epoll_event ev;
+    FETCH_HOST *host = conn->host;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->host = host;
+    conn->file = -1;
+    if ((conn->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    {
+        conn->sock = -1;
+        return;
+    }
+    //a refused connection shows up as an error event, failing what was sent on it
+    connect(conn->sock, (struct sockaddr *)&host->addr, sizeof(host->addr));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    epoll_ctl(fetchEpfd, EPOLL_CTL_ADD, conn->sock, &ev);
+    fetchFill(conn);
+}
+//drops a connection. the urls in flight on it go back to the front of the host's queue, in
+//order, to be sent again. if the server had been answering it is taken to have closed the
+//connection on reaching its request limit, otherwise each of them has used up an attempt.
+//it is reopened by fetchPool once the events already read for it are handled
+void fetchDrop(FETCH_CONN *conn, int failed)
+{
+    FETCH_HOST *host = conn->host;
+
+    close(conn->sock);
+    conn->sock = -1;
+    if (conn->file != -1)
+        close(conn->file);
+    conn->file = -1;
+    for (int n = conn->numInFlight - 1; n >= 0; n--)
+    {
+        int i = conn->inFlight[(conn->flightHead + n) % MAX_BENCH_PIPELINE];
+        if (failed && conn->answered == 0 && ++fetchUrls[i].attempts >= FETCH_ATTEMPTS)
+        {
+            fetchDone(&fetchUrls[i], host, 1);
+            continue;
+        }
+        fetchUrls[i].bytes = 0;
+        host->pendHead = (host->pendHead + host->capacity - 1) % host->capacity;
+        host->pending[host->pendHead] = i;
+        host->numPending++;
+    }
+    conn->numInFlight = 0;
+}
+//opens the connections of each host that has urls waiting, and hands urls to those that
+//have room for them
+void fetchPool(FETCH_HOST *hosts, int numHosts)
+{
+    for (int h = 0; h < numHosts; h++)
+    {
+        for (int c = 0; c < benchConnections && hosts[h].numPending > 0; c++)
+        {
+            FETCH_CONN *conn = &hosts[h].conns[c];
+            if (conn->sock == -1)
+                fetchConnect(conn);
+            else if (conn->numInFlight < benchPipeline && fetchFill(conn) < 0)
+                fetchDrop(conn, 1);
+        }
+    }
+}
+//the response at the head of the connection's pipeline has been read in full
+int fetchComplete(FETCH_CONN *conn)
+{
+    FETCH_URL *u = &fetchUrls[conn->inFlight[conn->flightHead]];
+
+    if (conn->file != -1)
+        close(conn->file);
+    conn->file = -1;
+    conn->flightHead = (conn->flightHead + 1) % MAX_BENCH_PIPELINE;
+    conn->numInFlight--;
+    conn->answered++;
+    conn->inBody = 0;
+    fetchDone(u, conn->host, 0);
+    if (conn->closeAfter)
+    {
+        fetchDrop(conn, 0);
+        return 1;
+    }
+    if (fetchFill(conn) < 0)
+    {
+        fetchDrop(conn, 1);
+        return 1;
+    }
+    return 0;
+}
+//finds the value of a response header in the headers gathered so far, or NULL
+char *fetchHeader(FETCH_CONN *conn, int headerLen, const char *name)
+{
+    int nameLen = strlen(name);
+    for (char *line = memchr(conn->buf, '\n', headerLen); line != NULL && line < conn->buf + headerLen;
+         line = memchr(line + 1, '\n', conn->buf + headerLen - line - 1))
+    {
+        if (strncasecmp(line + 1, name, nameLen) == 0 && line[1 + nameLen] == ':')
+            return line + 2 + nameLen + strspn(line + 2 + nameLen, " ");
+    }
+    return NULL;
+}
+//reads what has arrived on a connection, splitting it into responses and streaming each body
+//to its file
+void fetchRead(FETCH_CONN *conn)
+{
+    while (1)
+    {
+        int n = read(conn->sock, conn->buf + conn->len, BENCH_BUFF_SIZE - conn->len);
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+        {
+            //a body that runs until the connection closes is done, anything else failed
+            if (conn->inBody && conn->untilClose)
+            {
+                conn->closeAfter = 1;
+                fetchComplete(conn);
+            }
+            else
+            {
+                fetchDrop(conn, 1);
+            }
+            return;
+        }
+        conn->len += n;
+        while (conn->len > 0 && conn->numInFlight > 0)
+        {
+            FETCH_URL *u = &fetchUrls[conn->inFlight[conn->flightHead]];
+            if (!conn->inBody)
+            {
+                char *end = memmem(conn->buf, conn->len, "\r\n\r\n", 4);
+                if (end == NULL)
+                {
+                    if (conn->len == BENCH_BUFF_SIZE)
+                    {
+                        fetchDrop(conn, 1);
+                        return;
+                    }
+                    break;
+                }
+                int headerLen = end + 4 - conn->buf;
+                char *value;
+                u->status = conn->len > 12 ? atoi(conn->buf + 9) : 0;
+                conn->inBody = 1;
+                conn->untilClose = 0;
+                conn->closeAfter = (value = fetchHeader(conn, headerLen, "Connection")) != NULL && strncasecmp(value, "close", 5) == 0;
+                if ((value = fetchHeader(conn, headerLen, "Transfer-Encoding")) != NULL && strncasecmp(value, "chunked", 7) == 0)
+                {
+                    //chunked bodies are not decoded, the url fails rather than being saved wrong
+                    fprintf(stderr, "Chunked response to /%s is not supported\n", u->page);
+                    u->attempts = FETCH_ATTEMPTS;
+                    fetchDrop(conn, 1);
+                    return;
+                }
+                if (fetchHeadOnly || u->status == 204 || u->status == 304 || (u->status >= 100 && u->status < 200))
+                    conn->bodyLeft = 0;
+                else if ((value = fetchHeader(conn, headerLen, "Content-Length")) != NULL)
+                    conn->bodyLeft = atol(value);
+                else
+                    conn->untilClose = 1;
+                if (outputDir != NULL && u->status >= 200 && u->status <= 299 && !fetchHeadOnly &&
+                    (conn->file = fetchFile(conn->host, u)) == -1)
+                    fprintf(stderr, "Cannot save /%s: %s\n", u->page, strerror(errno));
+                conn->len -= headerLen;
+                memmove(conn->buf, conn->buf + headerLen, conn->len);
+            }
+            long take = conn->untilClose || conn->bodyLeft > conn->len ? conn->len : conn->bodyLeft;
+            if (conn->file != -1 && take > 0 && write(conn->file, conn->buf, take) != take)
+            {
+                close(conn->file);
+                conn->file = -1;
+            }
+            u->bytes += take;
+            if (!conn->untilClose)
+                conn->bodyLeft -= take;
+            conn->len -= take;
+            memmove(conn->buf, conn->buf + take, conn->len);
+            if (!conn->untilClose && conn->bodyLeft == 0 && fetchComplete(conn))
+                return;
+        }
+    }
+}
+//fetches every url, concurrently over a pool of kept alive connections to each host, and
+//reports the status and size of each. returns non zero if any could not be fetched
+int fetch(char **urls, int numUrls, char *method)
+{
+    struct epoll_event events[64];
+    char ip[200], page[200];
+    int port;
+    FETCH_HOST *hosts = calloc(numUrls > 0 ? numUrls : 1, sizeof(FETCH_HOST));
+    int numHosts = 0;
+
+    if (benchConnections < 1)
+        benchConnections = DEFAULT_FETCH_CONNECTIONS;
+    if (benchPipeline < 1)
+        benchPipeline = 1;
+    if (benchPipeline > MAX_BENCH_PIPELINE)
+        benchPipeline = MAX_BENCH_PIPELINE;
+    fetchMethod = method;
+    fetchHeadOnly = strcasecmp(method, "head") == 0;
+    fetchUrls = calloc(numUrls > 0 ? numUrls : 1, sizeof(FETCH_URL));
+    fetchLeft = numUrls;
+    fetchFailed = 0;
+
+    //group the urls by host, each host is resolved once
+    for (int i = 0; i < numUrls; i++)
+    {
+        int h;
+        port = DEFAULT_PORT;
+        page[0] = 0;
+        if (!parseUrl(urls[i], ip, &port, page))
+        {
+            fprintf(stderr, "Error parsing url %s. Try host.com:port/resource\n", urls[i]);
+            fetchUrls[i].host = -1;
+            fetchFailed++;
+            fetchLeft--;
+            continue;
+        }
+        for (h = 0; h < numHosts && (strcmp(hosts[h].name, ip) != 0 || hosts[h].port != port); h++)
+            ;
+        if (h == numHosts)
+        {
+            struct hostent *server = gethostbyname(ip);
+            strcpy(hosts[h].name, ip);
+            hosts[h].port = port;
+            if (server != NULL)
+            {
+                hosts[h].addr.sin_family = AF_INET;
+                memcpy(&hosts[h].addr.sin_addr.s_addr, server->h_addr, server->h_length);
+                hosts[h].addr.sin_port = htons(port);
+                hosts[h].resolved = 1;
+            }
+            numHosts++;
+        }
+        strcpy(fetchUrls[i].page, page);
+        fetchUrls[i].host = h;
+        hosts[h].capacity++;
+    }
+
+    fetchEpfd = epoll_create1(0);
+    for (int h = 0; h < numHosts; h++)
+    {
+        FETCH_HOST *host = &hosts[h];
+        host->pending = malloc(host->capacity * sizeof(int));
+        host->conns = calloc(benchConnections, sizeof(FETCH_CONN));
+        for (int i = 0; i < numUrls; i++)
+        {
+            if (fetchUrls[i].host == h && host->resolved)
+                host->pending[host->numPending++] = i;
+            else if (fetchUrls[i].host == h)
+                fetchDone(&fetchUrls[i], host, 1);
+        }
+        for (int c = 0; c < benchConnections; c++)
+        {
+            host->conns[c].host = host;
+            host->conns[c].sock = -1;
+        }
+    }
+
+    while (fetchLeft > 0)
+    {
+        fetchPool(hosts, numHosts);
+        int n = epoll_wait(fetchEpfd, events, 64, FETCH_TIMEOUT * 1000);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int h = 0; n == 0 && h < numHosts; h++)
+        {
+            for (int c = 0; c < benchConnections; c++)
+            {
+                if (hosts[h].conns[c].sock != -1)
+                    fetchDrop(&hosts[h].conns[c], 1);
+            }
+        }
+        for (int i = 0; i < n; i++)
+        {
+            FETCH_CONN *conn = events[i].data.ptr;
+            //dropped by an earlier event of this batch
+            if (conn->sock == -1)
+                continue;
+            if ((events[i].events & EPOLLOUT) && conn->outLen > 0 && fetchFlush(conn) < 0)
+            {
+                fetchDrop(conn, 1);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                fetchRead(conn);
+        }
+    }
+
+    for (int h = 0; h < numHosts; h++)
+    {
+        for (int c = 0; c < benchConnections; c++)
+        {
+            if (hosts[h].conns[c].sock != -1)
+                close(hosts[h].conns[c].sock);
+        }
+        free(hosts[h].conns);
+        free(hosts[h].pending);
+    }
+    close(fetchEpfd);
+    free(hosts);
+    free(fetchUrls);
+    if (fetchFailed > 0)
+        fprintf(stderr, "%d of %d urls could not be fetched\n", fetchFailed, numUrls);
+    return fetchFailed > 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,49 +15,721 @@
 #include <signal.h>
 #include <dirent.h>
 #include <stdarg.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <ctype.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/filter.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define BUFF_SIZE 512
-#define MAX_CLIENTS 10
-#define MAX_FILETYPES 100
+#define REQUEST_BUFF_SIZE 8192
+#define MAX_HEADERS 32
+#define MAX_SEGMENTS 64
+#define MAX_IOVECS 16
+//limits on the responses queued from one batch of pipelined requests
+#define MAX_PIPELINE 16
+#define MAX_PIPELINE_OUTPUT 65536
+//request scoped memory every connection keeps, the largest send buffer kept between
+//responses and the closed connections each thread keeps for the next ones
+#define ARENA_BLOCK_SIZE 16384
+#define MAX_KEPT_OUTPUT 262144
+#define MAX_SPARE_CONNECTIONS 64
+//the most a connection's send buffer may hold, and the largest body copied into it. bigger
+//files are sent from the file
+#define MAX_CONNECTION_OUTPUT (8 << 20)
+#define MAX_BUFFERED_BODY (1 << 20)
+//most byte ranges served from one request, more than that gets the whole file
+#define MAX_RANGES 8
+//most segments a single response can queue: a header and body per range and a closing line
+#define RESPONSE_SEGMENTS (2 * MAX_RANGES + 1)
+#define DEFAULT_BACKLOG 511
+//starting size of the mime type table, which doubles whenever it gets half full
+#define MIME_TABLE_SIZE 64
 #define MAX_LINESIZE 128
 #define DEFAULT_PORT 8000
 #define DEFAULT_ROOT_DIR "."
 #define DEFAULT_LOG_FILE "httpd.log"
 #define DEFAULT_PREFORKS 5
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_SEND_TIMEOUT 30
+#define DEFAULT_KEEPALIVE_REQUESTS 100
+#define MAX_EVENTS 256
+#define MAX_PATHSIZE 256
+#define DEFAULT_CACHE_SIZE 4096
+#define CACHE_BLOCK_SIZE 1024
+#define CACHE_ENTRIES 512
+#define CACHE_BUCKETS 1024
+#define LOG_RING_SIZE 65536
+#define DEFAULT_LOG_FLUSH_INTERVAL 100
+#define DEFAULT_LOG_FLUSH_SIZE 16384
+//bodies worth compressing on the fly, larger ones are only sent precompressed
+#define MIN_COMPRESS_SIZE 256
+#define MAX_COMPRESS_SIZE (1 << 20)
+#define BROTLI_QUALITY 5
+//directories whose index file is remembered by each worker, and the most index names
+#define INDEX_CACHE_SIZE 1024
+#define MAX_INDEX_FILES 16
+#define DEFAULT_INDEX_FILES "index.html,index.htm,default.htm"
+//paths whose descriptor and metadata each worker keeps, and the seconds they are trusted for.
+//the descriptors kept take at most a quarter of the process's limit, the rest is left to
+//connections
+#define FILE_CACHE_SIZE 1024
+#define FILE_CACHE_FD_SHARE 4
+//locks over the slots of the file and index caches, which the threads of a pool share
+#define FILE_CACHE_LOCKS 64
+#define DEFAULT_FILE_CACHE_TTL 2
+//bodies at least this many KB are sent from a shared mapping of their file where they cannot
+//be sent straight from the file, how much of one is read ahead when it is queued, and the
+//mappings worth backing with huge pages
+#define DEFAULT_MAP_MIN_SIZE 64
+#define MAP_READAHEAD (2 << 20)
+#define HUGE_PAGE_SIZE (2 << 20)
+//entries on one page of a directory listing
+#define LISTING_PAGE_SIZE 500
+//length of an IMF-fixdate, and the error pages each worker keeps rendered
+#define HTTP_DATE_SIZE 29
+#define MAX_ERROR_PAGES 16
+//reserved url of the metrics, and the listeners and latency buckets they cover
+#define METRICS_PATH "/__metrics"
+#define METRICS_LISTENERS 256
+#define LATENCY_BUCKETS 16
+#define METRIC_METHODS 4
+#define METRIC_STATUSES 11
+//stages whose latency is measured
+#define STAGE_PARSE 0
+#define STAGE_OPEN 1
+#define STAGE_HEADER 2
+#define STAGE_SEND 3
+#define NUM_STAGES 4
+//reasons a connection is closed for taking too long
+#define TIMEOUT_HEADER 0
+#define TIMEOUT_SEND 1
+#define TIMEOUT_IDLE 2
+#define NUM_TIMEOUTS 3
+//the timer wheel of the event engine: slots per level as a power of two, and levels, so it
+//spans 64^4 one second ticks
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+//connections each pool thread's deque holds
+#define POOL_QUEUE_SIZE 256
+#define URING_ENTRIES 256
+#define URING_FILES 4096
+#define URING_BUFFERS 64
+#define URING_BUFFER_SIZE 65536
 
-void processrequest(int sock);
-void processDirectory(int sock, char *path, char *host, int headOnly);
-void processFile(int sock, char *path, char *host, int headOnly);
+//states of the request parser
+#define PARSE_REQUEST_LINE 0
+#define PARSE_HEADERS 1
+#define PARSE_DONE 2
+#define PARSE_ERROR 3
+
+//operations in flight on the io_uring engine, kept in the low bits of the user data
+#define URING_TICK 0
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_TIMEOUT 3
+#define URING_SEND 4
+#define URING_READ 5
+#define URING_WRITE 6
+#define URING_IGNORE 7
+
+//content codings, as a mask of those a client accepts
+#define ENCODING_IDENTITY 0
+#define ENCODING_GZIP 1
+#define ENCODING_DEFLATE 2
+#define ENCODING_BR 4
+
+//states of a connection in the event driven engine
+#define CONN_READING 0
+#define CONN_SENDING_HEADER 1
+#define CONN_SENDING_BODY 2
+#define CONN_DONE 3
+//handed to a pool thread, the event thread leaves it alone until it comes back
+#define CONN_WORKING 4
+
+//a deadline in a timer wheel, in seconds of monotonicSeconds. timers are kept in circular
+//lists through the slots of the wheel, so one is set, moved or cancelled without a search
+typedef struct TIMER
+{
+    struct TIMER *prev;
+    struct TIMER *next;
+    unsigned long expires;
+} TIMER;
+
+//a hierarchical timer wheel ticking once a second. level 0 holds the timers due within
+//TIMER_SLOTS ticks and each level above covers TIMER_SLOTS times the span of the one below.
+//a slot of an upper level is spread over the levels below once they have come round to it
+typedef struct
+{
+    TIMER slots[TIMER_LEVELS][TIMER_SLOTS];
+    //the next tick to run
+    unsigned long now;
+} TIMER_WHEEL;
+
+//a growable byte buffer
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} BUFFER;
+
+//a block of an arena, allocations are bumped through data
+typedef struct ARENA_BLOCK
+{
+    struct ARENA_BLOCK *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ARENA_BLOCK;
+
+//memory that lives until the responses of a connection are sent and is then released in one
+//go. allocations come from the newest block, a block of ARENA_BLOCK_SIZE is kept across
+//resets and only what does not fit in it costs a malloc
+typedef struct
+{
+    ARENA_BLOCK *current;
+} ARENA;
+
+//a header line, as offsets into the receive buffer
+typedef struct
+{
+    int nameOff;
+    int nameLen;
+    int valueOff;
+    int valueLen;
+} HTTP_HEADER;
+
+//a parsed request. nothing is copied, every part is recorded as an offset into the receive
+//buffer. pos is where parsing resumes when more data arrives
+typedef struct
+{
+    int state;
+    int pos;
+    int methodOff;
+    int methodLen;
+    int targetOff;
+    int targetLen;
+    int versionOff;
+    int versionLen;
+    int numHeaders;
+    HTTP_HEADER headers[MAX_HEADERS];
+} HTTP_REQUEST;
+
+//a whole file mapped shared and read only. it is held by the file cache entry it was made
+//for and by every queued segment pointing into it, and unmapped when the last one lets go
+typedef struct
+{
+    char *addr;
+    size_t len;
+    _Atomic int refs;
+} MAPPING;
+
+//a part of the queued output. either bytes at offset in the out buffer, bytes at offset in a
+//file mapping or a range of a file
+typedef struct
+{
+    int fd;
+    off_t offset;
+    off_t len;
+    MAPPING *map;
+} SEGMENT;
+
+//a client connection. requests are read into in and the responses to them are queued, in
+//order, as segments. headers and generated bodies are gathered in out while file bodies
+//are sent straight from their file
+typedef struct CONNECTION
+{
+    int sock;
+    int state;
+    struct sockaddr_in addr;
+    char in[REQUEST_BUFF_SIZE + 1];
+    int inLen;
+    HTTP_REQUEST req;
+    //keep the connection open once the current response is sent
+    int keepAlive;
+    //number of requests served on this connection
+    int requests;
+    //when the connection last made progress, and when the first bytes of the request being
+    //read arrived, 0 while waiting for the next one, in seconds of monotonicSeconds
+    time_t lastActive;
+    time_t requestStart;
+    //event engine: the deadline of the timeout the connection is waiting on
+    TIMER timer;
+    //set while the client is not taking the responses as fast as they are sent
+    int stalled;
+    //time spent parsing the current request, and when sending the queued responses began
+    long parseNs;
+    long sendStart;
+    //the send buffer, kept between responses, and the memory of the requests being answered
+    BUFFER out;
+    ARENA arena;
+    SEGMENT segs[MAX_SEGMENTS];
+    int numSegs;
+    int curSeg;
+    //set while small writes are being held back to fill packets
+    int corked;
+    //pipe used to splice the body when the file system does not support sendfile
+    int useSplice;
+    int pipeFds[2];
+    size_t pipeLen;
+    //list of connections held by an event worker
+    struct CONNECTION *prev;
+    struct CONNECTION *next;
+    //thread pool: the client closed its side while the requests were being handled, and the
+    //list of handled connections waiting for the event thread
+    int peerClosed;
+    struct CONNECTION *poolNext;
+    //io_uring engine: completions still to come for the operations in flight, whether one of
+    //them failed, the registered buffer file bodies go through and the gathered send
+    int uringPending;
+    int uringFailed;
+    int uringFixed;
+    int uringBuf;
+    size_t uringBufLen;
+    size_t uringBufSent;
+    struct msghdr uringMsg;
+    struct iovec uringIov[MAX_IOVECS];
+    struct __kernel_timespec uringTimeout;
+} CONNECTION;
+
+//an io_uring instance with its submission and completion rings mapped
+typedef struct
+{
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    //entries queued since the last submit
+    unsigned toSubmit;
+    //registered buffers for file bodies, free ones are stacked
+    char *buffers;
+    int freeBuffers[URING_BUFFERS];
+    int numFree;
+    //connections waiting for a buffer, linked through next
+    CONNECTION *waiting;
+    //whether one accept keeps producing connections, otherwise it is rearmed for each
+    int multishotAccept;
+    //the timeout that wakes the loop once a second
+    struct __kernel_timespec tick;
+} URING;
+
+//the index file a directory resolved to, valid while the directory is unchanged
+typedef struct
+{
+    char path[MAX_PATHSIZE];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    //position in the index file list, -1 if the directory has none
+    int index;
+} INDEX_ENTRY;
+
+//an entry of a directory listing
+typedef struct
+{
+    char *name;
+    int isDir;
+    off_t size;
+    time_t mtime;
+} LISTING_ENTRY;
+
+//a supported mime type
+typedef struct
+{
+    //lowercase, NULL for an empty slot of the table
+    char *extension;
+    char *contentType;
+    //text that is worth compressing
+    int compressible;
+} MIME;
+
+//what a path resolved to when it was last looked at, trusted until checked is a ttl old
+typedef struct
+{
+    char path[MAX_PATHSIZE];
+    //whether the path exists, its metadata and the type of a file if so
+    int exists;
+    struct stat st;
+    MIME *mime;
+    //open descriptor of a regular file, -1 otherwise, and its mapping once it has been
+    //served from memory
+    int fd;
+    MAPPING *map;
+    time_t checked;
+} FILE_ENTRY;
+
+//the Date every response carries, shared by all workers. whoever first sees the second change
+//formats it into the slot not being read and flips current, so readers never see it half written
+typedef struct
+{
+    _Atomic time_t second;
+    _Atomic int current;
+    char value[2][HTTP_DATE_SIZE + 1];
+} HTTP_DATE;
+
+//status line and start of the Date field of a response, rendered once
+typedef struct
+{
+    int status;
+    char *message;
+    char line[64];
+    int len;
+} STATUS_LINE;
+
+//an error response, rendered the first time its status and message are served
+typedef struct
+{
+    int status;
+    char *message;
+    char fields[128];
+    int fieldsLen;
+    char body[512];
+    int bodyLen;
+} ERROR_PAGE;
+
+//a latency histogram. bucket i counts observations up to latencyBounds[i], the last one the rest
+typedef struct
+{
+    _Atomic unsigned long buckets[LATENCY_BUCKETS + 1];
+    _Atomic unsigned long count;
+    _Atomic unsigned long sumNs;
+} LATENCY;
+
+//counters shared by every worker, updated without a lock
+typedef struct
+{
+    //by method (GET, HEAD, TRACE, anything else) and by status, in the order of statusLines
+    //with anything else last
+    _Atomic unsigned long requests[METRIC_METHODS][METRIC_STATUSES];
+    _Atomic unsigned long bytesSent;
+    _Atomic unsigned long accepted;
+    _Atomic long connections;
+    //connections waiting to be accepted and the most that may, sampled by each listener's worker
+    int numListeners;
+    _Atomic int acceptQueue[METRICS_LISTENERS];
+    _Atomic int acceptLimit[METRICS_LISTENERS];
+    LATENCY stages[NUM_STAGES];
+    //connections whose client has stopped taking their responses, and those closed for
+    //taking too long by reason
+    _Atomic long stalled;
+    _Atomic unsigned long timeouts[NUM_TIMEOUTS];
+} METRICS;
+
+//log lines waiting to be written. a worker appends at tail and its writer thread drains from
+//head, each index is only ever moved by its own side so no lock is needed between them. the
+//threads of a pool take turns appending under lock
+typedef struct
+{
+    char data[LOG_RING_SIZE];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    pthread_mutex_t lock;
+    //lines lost because the ring was full
+    _Atomic unsigned long dropped;
+    //wakes the writer early once enough is waiting
+    int wakefd;
+} LOG_RING;
+
+//connections with complete requests waiting for one pool thread. the event thread pushes at
+//the bottom and the owner takes from the top, oldest first, while idle threads steal from
+//the bottom so the two ends rarely meet
+typedef struct
+{
+    pthread_mutex_t lock;
+    CONNECTION *items[POOL_QUEUE_SIZE];
+    unsigned int top;
+    unsigned int bottom;
+} WORK_DEQUE;
+
+//the threads a worker's event thread hands requests to
+typedef struct
+{
+    int numThreads;
+    WORK_DEQUE *deques;
+    //deque the next connection is pushed to
+    int next;
+    //connections queued over all deques, and threads asleep waiting for one
+    _Atomic int queued;
+    _Atomic int idle;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    //handled connections going back to the event thread, which doneFd wakes
+    pthread_mutex_t doneLock;
+    CONNECTION *done;
+    int doneFd;
+} THREAD_POOL;
+
+//a cached response. the key is the relative path and the entry is only used while the
+//file still has the same inode, size and modification time
+typedef struct
+{
+    char key[MAX_PATHSIZE];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    //header fields describing the body followed by the body itself
+    size_t headerLen;
+    size_t bodyLen;
+    int firstBlock;
+    int numBlocks;
+    int hashNext;
+    int lruPrev;
+    int lruNext;
+} CACHE_ENTRY;
+
+//content cache shared by all the workers. it lives in an anonymous shared mapping made
+//before forking, entries are kept in least recently used order and their data in blocks
+typedef struct
+{
+    pthread_mutex_t lock;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+    unsigned long invalidations;
+    size_t bytesUsed;
+    size_t maxObject;
+    int numBlocks;
+    int lruHead;
+    int lruTail;
+    int freeEntry;
+    int buckets[CACHE_BUCKETS];
+    CACHE_ENTRY entries[CACHE_ENTRIES];
+    unsigned char *blockUsed;
+    char *data;
+} CACHE;
+
+void processrequest(CONNECTION *conn, int len);
+void initParser(void);
+int parseRequest(HTTP_REQUEST *req, const char *buf, int len);
+const char *requestHeader(CONNECTION *conn, const char *name, int *len);
+int readrequest(CONNECTION *conn);
+void requestArrived(CONNECTION *conn, int n);
+int connectionTimeout(CONNECTION *conn, time_t *deadline);
+int requestLength(CONNECTION *conn);
+void handleRequest(CONNECTION *conn, int len);
+int handleRequests(CONNECTION *conn);
+void serveConnection(CONNECTION *conn);
+int sendResponse(CONNECTION *conn);
+int progressResponse(CONNECTION *conn);
+ssize_t sendBody(CONNECTION *conn, SEGMENT *seg);
+void streamFile(CONNECTION *conn, const char *path, int fd, off_t offset, off_t size);
+MAPPING *mapFile(const char *path);
+void releaseMapping(MAPPING *map);
+char *segmentData(CONNECTION *conn, SEGMENT *seg);
+void appendBuffer(BUFFER *buf, const char *data, size_t len);
+void appendFormat(BUFFER *buf, const char *format, ...);
+void appendOutput(CONNECTION *conn, const char *data, size_t len);
+void *arenaAlloc(ARENA *arena, size_t size);
+void arenaReset(ARENA *arena);
+void arenaFree(ARENA *arena);
+CONNECTION *newConnection(void);
+void releaseConnection(CONNECTION *conn);
+void initConnection(CONNECTION *conn, int sock, struct sockaddr_in *addr);
+void resetConnection(CONNECTION *conn);
+void serveBlocking(int sockfd, char *who);
+void eventLoop(int sockfd);
+int refuseConnection(int sockfd, int *spare);
+void poolStart(int epfd);
+int poolSubmit(CONNECTION *conn);
+CONNECTION *poolTake(int self);
+void *poolWorker(void *arg);
+void poolReturned(TIMER_WHEEL *wheel, CONNECTION **connections);
+void armTimeout(TIMER_WHEEL *wheel, CONNECTION *conn);
+void timerInit(TIMER_WHEEL *wheel);
+void timerAdd(TIMER_WHEEL *wheel, TIMER *timer);
+void timerSet(TIMER_WHEEL *wheel, TIMER *timer, unsigned long expires);
+void timerCancel(TIMER *timer);
+void timerAdvance(TIMER_WHEEL *wheel, unsigned long now, TIMER *expired);
+void runWorker(int sockfd, char *who);
+int openListener(int port, int backlog, int reusePort);
+void steerToCpu(int sockfd, int workers);
+void startWorker(int *listeners, int numListeners, int worker, char *who);
+int uringSupported(void);
+int uringProbeAccept(URING *ring);
+void uringSend(URING *ring, CONNECTION *conn);
+void uringReleaseBuffer(URING *ring, CONNECTION *conn);
+void uringLoop(int sockfd);
+void advanceSegments(CONNECTION *conn, ssize_t n);
+void processDirectory(CONNECTION *conn, char *path, char *rpath, char *query, char *host, int headOnly, struct stat *st);
+void setIndexFiles(char *list);
+const char *findIndex(const char *dirPath, struct stat *st);
+int serveListing(CONNECTION *conn, char *rpath, char *basePath, char *query, int headOnly);
+void processFile(CONNECTION *conn, char *path, char *rpath, char *host, int headOnly, FILE_ENTRY *file);
+void fileCacheInit(void);
+FILE_ENTRY *lookupFile(const char *path, FILE_ENTRY *copy);
+FILE_ENTRY *resolveFile(const char *path, unsigned slot, FILE_ENTRY *scratch);
+void lockFiles(unsigned slot);
+void unlockFiles(unsigned slot);
+void closeCachedFd(FILE_ENTRY *e);
+void dropCachedFds(void);
+void expireFiles(void);
+int openFile(const char *path, struct stat *st);
 void setMimeTypes(char *path);
-void request(int sock, char *resource, char *host, int headOnly);
-void trace(int sock, char *resource, char *host, char *echo);
+void addMime(const char *extension, const char *contentType, int compressible);
+MIME *findMime(const char *extension);
+void request(CONNECTION *conn, char *resource, char *host, int headOnly);
+void trace(CONNECTION *conn, char *resource, char *host, char *echo, int len);
+
+void serveErr(CONNECTION *conn, int headOnly, int statusCode, char *statusType, char *message);
+void writeHeader(CONNECTION *conn, int status, char *statusMessage, char *contentType, long contentLength);
 
-void serveErr(int sock, int headOnly, int statusCode, char *statusType, char *message);
+void cacheInit(size_t size);
+int cacheFetch(CONNECTION *conn, const char *key, struct stat *st, int status, char *statusMessage, int headOnly);
+void cacheStore(const char *key, struct stat *st, const char *header, size_t headerLen, const char *body, size_t bodyLen);
+void logCacheStats(void);
+void cacheClear(void);
+int cacheFile(CONNECTION *conn, const char *key, int fd, struct stat *st, char *contentType, int vary, int headOnly);
+int entityHeader(char *buffer, char *contentType, long contentLength);
+int fileHeader(char *buffer, char *contentType, long contentLength, struct stat *st, int encoding, int vary);
+int fileValidators(char *buffer, struct stat *st, int encoding);
+void fileETag(struct stat *st, int encoding, char *etag);
+int codingHeader(char *buffer, int encoding, int vary);
+int acceptedEncodings(CONNECTION *conn);
+int chooseEncoding(CONNECTION *conn, const char *path, struct stat *st, int compressible, char *variant, int *precompressed);
+char *compressBody(ARENA *arena, const char *body, size_t len, int encoding, size_t *outLen);
+int compressFile(CONNECTION *conn, const char *key, int fd, struct stat *st, char *contentType, int encoding, int headOnly);
+int preferredEncoding(int accepted);
+void writeCompressible(CONNECTION *conn, const char *key, struct stat *st, char *contentType, const char *body, size_t len, int encoding, int headOnly);
+void httpDate(time_t t, char *buffer);
+int notModified(CONNECTION *conn, struct stat *st, const char *etag);
+int requestedRanges(CONNECTION *conn, struct stat *st, const char *etag, off_t *starts, off_t *ends);
+void serveRanges(CONNECTION *conn, const char *path, int fd, struct stat *st, char *contentType, off_t *starts, off_t *ends, int count, int headOnly);
+void writeHeaderFields(CONNECTION *conn, int status, char *statusMessage, const char *fields, size_t len);
+void headerInit(void);
+void metricsInit(int numListeners);
+long monotonicNs(void);
+time_t monotonicSeconds(void);
+void observeLatency(int stage, long ns);
+void countRequest(const char *method, int status);
+void countSent(ssize_t n);
+void countTimeout(int kind);
+void setStalled(CONNECTION *conn, int stalled);
+void sampleAcceptQueue(int force);
+void serveMetrics(CONNECTION *conn, int headOnly);
+const char *currentDate(void);
+
+void startLogWriter(void);
+void writelogLine(const char *line, size_t len);
+const char *logTimestamp(void);
 
 void writelogMessage(char *message, ...);
 void writelogStatus(char *method, char *host, char *resource, int status);
 
 void catch (int signo);
 void claim_zombie();
+void request_stats(int signo);
 
 int daemon_init(void);
 
-FILE *logfile;
+int logfd = -1;
+//ring of the current worker, NULL until its writer thread is running
+LOG_RING *logRing = NULL;
+//milliseconds between log writes, and the backlog that triggers one sooner
+int logFlushInterval = DEFAULT_LOG_FLUSH_INTERVAL;
+int logFlushSize = DEFAULT_LOG_FLUSH_SIZE;
 char *rootdir = DEFAULT_ROOT_DIR;
-typedef struct
-{
-    char extension[MAX_LINESIZE];
-    char contentType[MAX_LINESIZE];
-} MIME;
+//seconds an idle persistent connection is kept open for
+int keepAliveTimeout = DEFAULT_KEEPALIVE_TIMEOUT;
+//seconds a client has to send a whole request header, and to take more of a response. 0
+//waits forever
+int headerTimeout = DEFAULT_HEADER_TIMEOUT;
+int sendTimeout = DEFAULT_SEND_TIMEOUT;
+//requests served on one connection before it is closed
+int keepAliveRequests = DEFAULT_KEEPALIVE_REQUESTS;
+//engine the workers run
+int useEpoll = 0;
+int useUring = 0;
+//pin each worker to a core
+int pinWorkers = 0;
+//threads each worker hands requests to, 0 handles them on the event thread. the pool of the
+//current worker, NULL without one
+int poolThreads = 0;
+THREAD_POOL *pool = NULL;
+//closed connections of the current thread, ready to be handed out again with their buffers
+__thread CONNECTION *spareConnections = NULL;
+__thread int numSpareConnections = 0;
+//index file names in priority order
+char *indexFiles[MAX_INDEX_FILES];
+int numIndexFiles = 0;
+//index files of recently requested directories and descriptors and metadata of recently
+//requested paths, per worker and shared by the threads of its pool under fileCacheLocks
+INDEX_ENTRY indexCache[INDEX_CACHE_SIZE];
+FILE_ENTRY fileCache[FILE_CACHE_SIZE];
+pthread_mutex_t fileCacheLocks[FILE_CACHE_LOCKS];
+int fileCacheTtl = DEFAULT_FILE_CACHE_TTL;
+//descriptors the file cache of a worker may keep open, and how many it does
+int maxCachedFds = FILE_CACHE_SIZE;
+_Atomic int cachedFds = 0;
+//smallest body sent from a mapping in bytes, 0 never maps
+off_t mapMinSize = DEFAULT_MAP_MIN_SIZE * 1024;
+//shared content cache, NULL when disabled
+CACHE *cache = NULL;
+//shared Date field and the response templates
+HTTP_DATE *httpNow = NULL;
+STATUS_LINE statusLines[] = {
+    {.status = 200, .message = "OK"},
+    {.status = 206, .message = "Partial Content"},
+    {.status = 304, .message = "Not Modified"},
+    {.status = 400, .message = "Bad Request"},
+    {.status = 404, .message = "Not Found"},
+    {.status = 405, .message = "Method Not Allowed"},
+    {.status = 415, .message = "Unsupported Media Type"},
+    {.status = 416, .message = "Range Not Satisfiable"},
+    {.status = 431, .message = "Request Header Fields Too Large"},
+    {.status = 500, .message = "Internal Server Error"},
+};
+//error pages rendered so far by this worker thread
+__thread ERROR_PAGE errorPages[MAX_ERROR_PAGES];
+__thread int numErrorPages = 0;
+//shared counters, and the listener this worker accepts from
+METRICS *metrics = NULL;
+const long latencyBounds[LATENCY_BUCKETS] = {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+                                             1000000, 2500000, 5000000, 10000000, 25000000, 100000000, 1000000000};
+const char *stageNames[NUM_STAGES] = {"parse", "open", "header", "send"};
+const char *timeoutNames[NUM_TIMEOUTS] = {"header", "send", "idle"};
+int listenSock = -1;
+int listenIndex = 0;
+//set by SIGUSR1 to have the cache counters written to the log
+volatile sig_atomic_t statsRequested = 0;
 
-int numMimes = 6;
-MIME mimes[MAX_FILETYPES] = {
-    {"html", "text/html"},
-    {"htm", "text/html"},
-    {"txt", "text/plain"},
-    {"jpeg", "image/jpeg"},
-    {"jpg", "image/jpeg"},
-    {"gif", "image/gif"}};
+//the built in types, generated from mime.types by the makefile
+MIME defaultMimes[] = {
+#include "mimetypes.h"
+};
+//mime types by extension, open addressed with linear probing
+MIME *mimeTable = NULL;
+int mimeTableSize = 0;
+int numMimes = 0;
 /**
  * @brief      Set up socket for server to bind to and then start listening, when client has connected process will be called
  *
@@ -66,13 +739,17 @@ MIME mimes[MAX_FILETYPES] = {
 int main(int argc, char *argv[])
 {
     int portno = DEFAULT_PORT;
-    int preforks = DEFAULT_PREFORKS;
+    int preforks = -1;
+    int backlog = DEFAULT_BACKLOG;
+    int reusePort = 0;
     char *logfilename = DEFAULT_LOG_FILE;
     char *mimtypeFilePath = NULL;
+    char *indexList = DEFAULT_INDEX_FILES;
+    int cacheSize = DEFAULT_CACHE_SIZE;
 
     int opt;
 
-    while ((opt = getopt(argc, argv, "p:d:l:m:f:")) != -1)
+    while ((opt = getopt(argc, argv, "p:d:l:m:x:o:M:f:t:eusab:k:h:g:r:c:i:w:")) != -1)
     {
         switch (opt)
         {
@@ -94,28 +771,102 @@ int main(int argc, char *argv[])
             mimtypeFilePath = optarg;
             fprintf(stdout, "Using %s as the supported mime type file\r\n", optarg);
             break;
+        case 'x':
+            indexList = optarg;
+            break;
+        case 'o':
+            fileCacheTtl = atoi(optarg);
+            break;
+        case 'M':
+            mapMinSize = (off_t)atoi(optarg) * 1024;
+            break;
         case 'f':
             preforks = atoi(optarg);
             break;
+        case 't':
+            poolThreads = atoi(optarg);
+            break;
+        case 'e':
+            useEpoll = 1;
+            break;
+        case 'u':
+            useUring = 1;
+            break;
+        case 's':
+            reusePort = 1;
+            break;
+        case 'a':
+            pinWorkers = 1;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'k':
+            keepAliveTimeout = atoi(optarg);
+            break;
+        case 'h':
+            headerTimeout = atoi(optarg);
+            break;
+        case 'g':
+            sendTimeout = atoi(optarg);
+            break;
+        case 'r':
+            keepAliveRequests = atoi(optarg);
+            break;
+        case 'c':
+            cacheSize = atoi(optarg);
+            break;
+        case 'i':
+            logFlushInterval = atoi(optarg);
+            break;
+        case 'w':
+            logFlushSize = atoi(optarg);
+            break;
         default:
             fprintf(stderr, "Usage: \r\n%s \t[ -p <port number> ]\r\n\
             \t[ -d <document root> ]\r\n\
             \t[ -l <log file> ]\r\n\
             \t[ -m <file for mime types> ]\r\n\
-            \t[ -f <number of preforks> ]",
+            \t[ -x <comma separated index files, in priority order> ]\r\n\
+            \t[ -o <seconds open files are trusted for, 0 checks every request> ]\r\n\
+            \t[ -M <KB from which io_uring sends bodies from a file mapping, 0 never> ]\r\n\
+            \t[ -f <number of preforks, defaults to one per core with -s> ]\r\n\
+            \t[ -t <threads every worker hands requests to, runs the epoll engine> ]\r\n\
+            \t[ -e ] Use the epoll event engine instead of blocking workers\r\n\
+            \t[ -u ] Use the io_uring engine, falling back to the above if unsupported\r\n\
+            \t[ -s ] Give every worker its own SO_REUSEPORT listener\r\n\
+            \t[ -a ] Pin every worker to a core\r\n\
+            \t[ -b <listen backlog> ]\r\n\
+            \t[ -k <keep-alive timeout in seconds> ]\r\n\
+            \t[ -h <seconds a client has to send a request header, 0 waits forever> ]\r\n\
+            \t[ -g <seconds a response may go without the client taking any of it, 0 waits forever> ]\r\n\
+            \t[ -r <max requests per connection> ]\r\n\
+            \t[ -c <content cache size in KB, 0 disables> ]\r\n\
+            \t[ -i <log flush interval in ms> ]\r\n\
+            \t[ -w <log flush size in bytes> ]",
                     argv[0]);
             exit(EXIT_FAILURE);
         }
     }
+    //the pool is fed by the epoll engine's event thread, so it cannot run under io_uring
+    if (poolThreads > 0 && useUring)
+    {
+        fprintf(stderr, "ERROR: -t runs the epoll engine and cannot be combined with -u\r\n");
+        exit(EXIT_FAILURE);
+    }
     //Open logfile file for writing overwriting the exsiting file
 
-    if ((logfile = fopen(logfilename, "w+")) == NULL)
+    //appends from every worker land as whole lines
+    if ((logfd = open(logfilename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1)
     {
         fprintf(stderr, "Error trying to open log file.");
         exit(1);
     }
 
     setMimeTypes(mimtypeFilePath);
+    setIndexFiles(indexList);
+    fileCacheInit();
+    initParser();
 
     //check valid port no
     if (portno < 0 || portno > 65535)
@@ -126,12 +877,10 @@ int main(int argc, char *argv[])
 
     daemon_init();
 
-    int sockfd, newsockfd, clilen;
-
-    // Struct that holds a socket address, server address and client address
-    struct sockaddr_in serv_addr, cli_addr;
-    // Int holding variable and a process ID
-    int n, pid;
+    //the cache, Date and metrics have to be mapped before forking so every worker shares them
+    headerInit();
+    if (cacheSize > 0)
+        cacheInit((size_t)cacheSize * 1024);
 
     // Declaring the signal handler for handling zombie and control c
     struct sigaction act;
@@ -139,9 +888,95 @@ int main(int argc, char *argv[])
     sigemptyset(&act.sa_mask);
     act.sa_flags = SA_NOCLDSTOP;
     sigaction(SIGCHLD, (struct sigaction *)&act, (struct sigaction *)0);
+    //SIGUSR1 writes the cache counters to the log
+    act.sa_handler = request_stats;
+    act.sa_flags = 0;
+    sigaction(SIGUSR1, (struct sigaction *)&act, (struct sigaction *)0);
+
+    //a single worker per core unless told otherwise, counting the main server
+    if (preforks < 0)
+        preforks = reusePort ? sysconf(_SC_NPROCESSORS_ONLN) - 1 : DEFAULT_PREFORKS;
+    if (backlog <= 0)
+        backlog = DEFAULT_BACKLOG;
+
+    //workers either share one listener or, sharded, each get their own so the kernel spreads
+    //connections over separate accept queues instead of waking every worker for each one.
+    //the listeners are opened here in worker order, which is the order of the reuseport group
+    int numListeners = reusePort ? preforks + 1 : 1;
+    int listeners[numListeners];
+    metricsInit(numListeners);
+    for (int i = 0; i < numListeners; i++)
+    {
+        listeners[i] = openListener(portno, backlog, reusePort);
+        //the rest of the group has to bind the port the first one got
+        struct sockaddr_in serv_addr;
+        socklen_t len = sizeof(serv_addr);
+        if (getsockname(listeners[i], (struct sockaddr *)&serv_addr, &len) == 0)
+            portno = ntohs(serv_addr.sin_port);
+    }
+    // Print to log file that server is now listening
+    fprintf(stdout, "Server is listening on port: %d\r\n", portno);
+    writelogMessage("Server is listening on port: %d", portno);
+    if (reusePort)
+    {
+        writelogMessage("Using %d SO_REUSEPORT listeners", numListeners);
+        if (pinWorkers)
+            steerToCpu(listeners[0], numListeners);
+    }
+
+    // Ignore SIGPIPE signal, interupted requests wont fail
+    signal(SIGPIPE, SIG_IGN);
+#ifdef PROFILE_BUILD
+    signal(SIGTERM, catch);
+#endif
+    if (poolThreads > 0)
+        useEpoll = 1;
+    if (useUring && !uringSupported())
+    {
+        fprintf(stderr, "io_uring is not supported by this kernel, using the %s engine\r\n", useEpoll ? "epoll" : "prefork");
+        writelogMessage("io_uring is not supported, falling back");
+        useUring = 0;
+    }
+    if (useUring)
+        writelogMessage("Using the io_uring engine");
+    //in epoll mode every worker multiplexes its connections on a non blocking listener
+    if (useEpoll)
+    {
+        for (int i = 0; i < numListeners; i++)
+            fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL, 0) | O_NONBLOCK);
+        writelogMessage("Using the epoll event engine");
+    }
+    //preforks
+    //https://github.com/shenfeng/tiny-web-server
+    writelogMessage("Using %d spare servers", preforks);
+    for (int i = 1; i <= preforks; i++)
+    {
+        int pid = fork();
+        if (pid == 0)
+        { //  child
+            startWorker(listeners, numListeners, i, "forked child");
+        }
+        else if (pid > 0)
+        {
+            writelogMessage("Forked child pid is %d", pid);
+        }
+        else
+        {
+            perror("fork");
+        }
+    }
+
+    startWorker(listeners, numListeners, 0, "main server");
+}
+//opens a listening socket on the port, joined to the port's reuseport group if asked to
+int openListener(int port, int backlog, int reusePort)
+{
+    int one = 1;
+    // Struct that holds a socket address for the server
+    struct sockaddr_in serv_addr;
 
     //Call to socket function using address family and socket connection
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
     // Check if socket returns value less then 0
     if (sockfd < 0)
@@ -149,6 +984,11 @@ int main(int argc, char *argv[])
         perror("ERROR opening socket");
         exit(1);
     }
+    if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        perror("ERROR setting SO_REUSEPORT");
+        exit(1);
+    }
 
     /* Initialize socket structure */
     // Define socket structure and use b zero to set all sockets to NULL
@@ -158,7 +998,7 @@ int main(int argc, char *argv[])
     // Server addreessed set accdirListingting all IP address
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     // Set port number to host to network short
-    serv_addr.sin_port = htons(portno);
+    serv_addr.sin_port = htons(port);
 
     //Bind socketfd with the server address using Bind function
     if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
@@ -167,243 +1007,2433 @@ int main(int argc, char *argv[])
         perror("ERROR on binding");
         exit(1);
     }
-    socklen_t len = sizeof(serv_addr);
-    if (getsockname(sockfd, (struct sockaddr *)&serv_addr, &len) == -1)
-    {
-        perror("ERROR on getsockname");
-    }
-    else
-    {
-        // Print to log file that server is now listening
-        fprintf(stdout, "Server is listening on port: %d\r\n", ntohs(serv_addr.sin_port));
-        writelogMessage("Server is listening on port: %d", ntohs(serv_addr.sin_port));
-    }
 
-    // Listen for socket fd and can accept a log of MAX_CLIENTS connections
-    if (listen(sockfd, MAX_CLIENTS) < 0)
+    // Listen for socket fd, queueing up to backlog connections that are yet to be accepted
+    if (listen(sockfd, backlog) < 0)
         perror("ERROR on listen");
 
-    // Ignore SIGPIPE signal, interupted requests wont fail
-    signal(SIGPIPE, SIG_IGN);
-    //preforks
-    //https://github.com/shenfeng/tiny-web-server
-    writelogMessage("Using %d spare servers", preforks);
-    for (int i = 0; i < preforks; i++)
+    return sockfd;
+}
+//sends each connection to the listener of the worker on the core that took the packet, so a
+//connection is accepted and served on the core its interrupts already run on
+void steerToCpu(int sockfd, int workers)
+{
+    struct sock_filter code[] = {
+        //A = the current cpu
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        //A = A % workers, the index of the listener in the group
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+        perror("ERROR steering connections to cores");
+}
+//sets up a worker process: keeps only its own listener when sharded, pins it to its core
+//when asked to and runs the engine
+void startWorker(int *listeners, int numListeners, int worker, char *who)
+{
+    int sockfd = listeners[numListeners > 1 ? worker : 0];
+
+    listenSock = sockfd;
+    listenIndex = numListeners > 1 ? worker : 0;
+    for (int i = 0; numListeners > 1 && i < numListeners; i++)
     {
-        int pid = fork();
-        if (pid == 0)
-        { //  child
-            while (1)
-            {
-                //accepts the connection of the next available client based on the client address
-                newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &len);
-                writelogMessage("Client IP: %s connected using forked child PID: %d", inet_ntoa(cli_addr.sin_addr), getpid());
-                processrequest(newsockfd);
-                close(newsockfd);
-                writelogMessage("Disconnected client IP: %s connection from forked child PID: %d", inet_ntoa(cli_addr.sin_addr), getpid());
-            }
-        }
-        else if (pid > 0)
-        {
-            writelogMessage("Forked child pid is %d", pid);
-        }
-        else
-        {
-            perror("fork");
-        }
+        if (i != worker)
+            close(listeners[i]);
+    }
+    if (pinWorkers)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker % sysconf(_SC_NPROCESSORS_ONLN), &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            perror("ERROR pinning worker");
     }
+    runWorker(sockfd, who);
+}
+//runs a worker on the engine picked at start up. if io_uring cannot be set up in this
+//process the worker drops back to the epoll or prefork engine
+void runWorker(int sockfd, char *who)
+{
+    if (useUring)
+        uringLoop(sockfd);
+    if (useEpoll)
+        eventLoop(sockfd);
+    else
+        serveBlocking(sockfd, who);
+}
+//accepts one client at a time and serves it until the connection is closed
+void serveBlocking(int sockfd, char *who)
+{
+    //one connection at a time, so its buffers are simply kept for the next
+    CONNECTION conn = {0};
+    struct sockaddr_in cli_addr;
+    socklen_t len;
 
+    startLogWriter();
+    //wake from accept once a second to close the files no longer requested
+    struct timeval tick = {1, 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
     while (1)
     {
-        //accepts the connection of the next available client based on the client address
-        newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &len);
-        writelogMessage("Client IP: %s connected using main server PID: %d", inet_ntoa(cli_addr.sin_addr), getpid());
-        processrequest(newsockfd);
+        len = sizeof(cli_addr);
+        //accepts the connection of the next available client based on the client address. it
+        //does not block, every wait on it is a poll bounded by the timeout it is waiting on
+        int newsockfd = accept4(sockfd, (struct sockaddr *)&cli_addr, &len, SOCK_NONBLOCK);
+        if (statsRequested)
+            logCacheStats();
+        sampleAcceptQueue(0);
+        expireFiles();
+        //out of descriptors, give back the ones the file cache is keeping
+        if (newsockfd < 0 && (errno == EMFILE || errno == ENFILE))
+            dropCachedFds();
+        if (newsockfd < 0)
+            continue;
+        initConnection(&conn, newsockfd, &cli_addr);
+        writelogMessage("Client IP: %s connected using %s PID: %d", inet_ntoa(cli_addr.sin_addr), who, getpid());
+        serveConnection(&conn);
+        resetConnection(&conn);
         close(newsockfd);
-        writelogMessage("Disconnected client IP: %s connection from main server PID: %d", inet_ntoa(cli_addr.sin_addr), getpid());
+        atomic_fetch_sub_explicit(&metrics->connections, 1, memory_order_relaxed);
+        writelogMessage("Disconnected client IP: %s connection from %s PID: %d", inet_ntoa(cli_addr.sin_addr), who, getpid());
     }
 }
-//sets the supported mime types from a specified mime type file
-void setMimeTypes(char *path)
+//serves requests on a blocking connection until the client or the server ends it
+void serveConnection(CONNECTION *conn)
 {
-    char buffer[BUFF_SIZE];
-    //check the mime type file here
-    if (path != NULL)
+    while (readrequest(conn) > 0)
     {
-
-        FILE *mimefile = fopen(path, "r");
-        if (mimefile != NULL)
-        {
-            //reset the previous (default mimes)
-            memset(mimes, 0, sizeof(mimes));
-
-            char line[256];
-            numMimes = 0;
-            char *lineToken = NULL;
-            //foreach line in the file set the mime array stucture accordingly
-            while (fgets(line, sizeof(line), mimefile) != NULL)
-            {
-
-                strcpy(mimes[numMimes].extension, strtok(line, " "));
-                strcpy(mimes[numMimes].contentType, strtok(NULL, "\r\r\n"));
-
-                numMimes++;
-            }
-            fclose(mimefile);
-        }
-        else
-        {
-            perror(path);
-            fprintf(stderr, "Using default mimes\r\n");
-        }
+        handleRequests(conn);
+        int sent = sendResponse(conn);
+        //the client took none of the response for the send timeout
+        if (sent == 0)
+            countTimeout(TIMEOUT_SEND);
+        if (sent != 1 || !conn->keepAlive)
+            break;
+        resetConnection(conn);
     }
 }
-//writes an info message to the log file using a simple formatter and date
-void writelogMessage(char *message, ...)
+//takes a connection from the thread's spares, or allocates one. either way it still has to be
+//set up with initConnection
+CONNECTION *newConnection(void)
 {
-    va_list arg;
-    char s[1000];
-    char buffer[BUFF_SIZE];
+    CONNECTION *conn = spareConnections;
 
-    time_t t = time(NULL);
-    struct tm *p = localtime(&t);
-
-    strftime(s, 1000, "%a, %d %b %Y %H:%M:%S %Z", p);
-
-    va_start(arg, message);
-    vsprintf(buffer, message, arg);
-    va_end(arg);
-
-    fprintf(logfile, "[ %s ] [ INFO ] %s \r\n", s, buffer);
-
-    fflush(logfile);
+    if (conn == NULL)
+        return calloc(1, sizeof(CONNECTION));
+    spareConnections = conn->next;
+    numSpareConnections--;
+    return conn;
 }
-//writes the status to the log file. contains the method, host, resource, status
-void writelogStatus(char *method, char *host, char *resource, int status)
+//gives back a closed and reset connection. it is kept, buffers and all, for the next one the
+//thread accepts unless the thread already has enough of them
+void releaseConnection(CONNECTION *conn)
 {
-    //https://stackoverflow.com/questions/9101590/fprintf-and-ctime-without-passing-n-from-ctime
-    char s[1000];
-
-    time_t t = time(NULL);
-    struct tm *p = localtime(&t);
-
-    strftime(s, 1000, "%a, %d %b %Y %H:%M:%S %Z", p);
-    fprintf(logfile, "[ %s ] %s %s %s %d\r\n", s, method, host, resource, status);
-    fflush(logfile);
+    if (numSpareConnections >= MAX_SPARE_CONNECTIONS)
+    {
+        free(conn->out.data);
+        arenaFree(&conn->arena);
+        free(conn);
+        return;
+    }
+    conn->next = spareConnections;
+    spareConnections = conn;
+    numSpareConnections++;
 }
-
-//process the request on the nominated socket
-void processrequest(int sock)
+//sets up a connection structure for a newly accepted socket. the send buffer and arena of a
+//reused structure are kept
+void initConnection(CONNECTION *conn, int sock, struct sockaddr_in *addr)
 {
+    BUFFER out = conn->out;
+    ARENA arena = conn->arena;
 
-    int n;
-    // Char buffer size BUFF_SIZE holding header
-    char buffer[BUFF_SIZE];
-    //Setting all values in buffer to zero
-    bzero(buffer, BUFF_SIZE);
-    //Read in from sock to buffer with size of BUFF_SIZE
-    // if read in value is less then 0 then print error
-    if ((read(sock, buffer, BUFF_SIZE)) < 0)
-    {
-        perror("ERROR reading from socket");
-        return;
-    }
-    //duplicate the request, this is to be used later in the trace method
-    char *requestDuplicate = malloc(strlen(buffer) + 1);
-    strcpy(requestDuplicate, buffer);
-    //tokenise the request
-    char *requestToken = NULL;
-    //used to  preserve the state of the token
-    char *requestTokenSave;
-
-    //get the first line which contains the method, resource and version
-    requestToken = strtok_r(buffer, "\r\n", &requestTokenSave);
-    char *statusToken;
-    //used to  preserve the state of the token
-    char *statusTokenSave;
-    statusToken = strtok_r(requestToken, " ", &statusTokenSave);
-
-    //get the second line which contains the host name
-    //Assume the host will always be the second line of the request. this might not always be the case.
-    //Needs to be considered
-    requestToken = strtok_r(NULL, "\r\n", &requestTokenSave);
-    char *hostToken;
-    //used to  preserve the state of the token
-    char *hostTokenSave;
-
-    hostToken = strtok_r(requestToken, " ", &hostTokenSave);
-    //make sure the host is actually available, otherwise return nothing
-    //issue when the host is not infact the second line
-    if (strcasecmp(hostToken, "HOST:") != 0)
+    //the receive buffer only needs its length cleared
+    memset(conn, 0, offsetof(CONNECTION, in));
+    memset(&conn->inLen, 0, sizeof(*conn) - offsetof(CONNECTION, inLen));
+    conn->out = out;
+    conn->out.len = 0;
+    conn->arena = arena;
+    conn->sock = sock;
+    conn->addr = *addr;
+    conn->state = CONN_READING;
+    conn->pipeFds[0] = conn->pipeFds[1] = -1;
+    //a client that connects and sends nothing is held to the header deadline too
+    conn->lastActive = conn->requestStart = monotonicSeconds();
+    atomic_fetch_add_explicit(&metrics->accepted, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics->connections, 1, memory_order_relaxed);
+}
+//releases the response the connection holds so the next request can be served
+void resetConnection(CONNECTION *conn)
+{
+    for (int i = 0; i < conn->numSegs; i++)
     {
-        serveErr(sock, 0, 400, "Bad Request", "The server could not process the request");
-        writelogStatus(statusToken, "NO HOST PROVIDED", "", 400);
+        if (conn->segs[i].fd != -1)
+            close(conn->segs[i].fd);
+        releaseMapping(conn->segs[i].map);
     }
-    else
+    conn->numSegs = conn->curSeg = 0;
+    //the send buffer is kept for the next response unless an unusually large one grew it
+    if (conn->out.cap > MAX_KEPT_OUTPUT)
     {
-        //move forward, this contains the actual host name now
-        hostToken = strtok_r(NULL, " ", &hostTokenSave);
-        //remove the newline character
-        hostToken[strcspn(hostToken, "\r\n")] = 0;
-
-        if (strcasecmp(statusToken, "GET") == 0)
-        {
-            //get resource token
-            statusToken = strtok_r(NULL, " ", &statusTokenSave);
-            request(sock, statusToken, hostToken, 0);
-        }
-        else if (strcasecmp(statusToken, "TRACE") == 0)
-        {
-            //get resource token
-            statusToken = strtok_r(NULL, " ", &statusTokenSave);
-            //send request token to trace method
-            trace(sock, statusToken, hostToken, requestDuplicate);
-            // trace(sock, statusToken, hostToken, 0);
-        }
-        else if (strcasecmp(statusToken, "HEAD") == 0)
-        {
-            //get resource token
-            statusToken = strtok_r(NULL, " ", &statusTokenSave);
-            request(sock, statusToken, hostToken, 1);
-        }
-        else
-        {
-            //method not supported
-            serveErr(sock, 0, 405, "Method Not Allowed", "The server could not process the requested method");
-
-            writelogStatus(statusToken, hostToken, strtok_r(NULL, " ", &statusTokenSave), 405);
-        }
+        free(conn->out.data);
+        memset(&conn->out, 0, sizeof(conn->out));
     }
-
-    free(requestDuplicate);
+    conn->out.len = 0;
+    arenaReset(&conn->arena);
+    if (conn->pipeFds[0] != -1)
+    {
+        close(conn->pipeFds[0]);
+        close(conn->pipeFds[1]);
+        conn->pipeFds[0] = conn->pipeFds[1] = -1;
+    }
+    conn->pipeLen = 0;
+    conn->sendStart = 0;
+    setStalled(conn, 0);
+    conn->state = CONN_READING;
 }
-void writeHeader(int sock, int status, char *statusMessage, char *contentType)
+//allocates request scoped memory, 16 byte aligned. returns NULL if it cannot be had
+void *arenaAlloc(ARENA *arena, size_t size)
 {
-    char buffer[BUFF_SIZE];
-    char s[1000];
+    ARENA_BLOCK *b = arena->current;
 
-    time_t t = time(NULL);
-    struct tm *p = localtime(&t);
+    size = (size + 15) & ~(size_t)15;
+    if (b == NULL || b->size - b->used < size)
+    {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        if ((b = malloc(sizeof(ARENA_BLOCK) + blockSize)) == NULL)
+            return NULL;
+        b->size = blockSize;
+        b->used = 0;
+        b->next = arena->current;
+        arena->current = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+//releases everything allocated since the last reset. the oldest block is kept if it is of the
+//usual size, so a connection whose requests fit in it never goes back to malloc
+void arenaReset(ARENA *arena)
+{
+    ARENA_BLOCK *b = arena->current;
 
-    strftime(s, 1000, "%a, %d %b %Y %H:%M:%S %Z", p);
-    sprintf(buffer, "HTTP/1.1 %d %s\r\nDate: %s\r\nContent-Type: %s\r\n\r\n", status, statusMessage, s, contentType);
-    write(sock, buffer, strlen(buffer));
+    while (b != NULL && (b->next != NULL || b->size != ARENA_BLOCK_SIZE))
+    {
+        ARENA_BLOCK *next = b->next;
+        free(b);
+        b = next;
+    }
+    arena->current = b;
+    if (b != NULL)
+        b->used = 0;
 }
-//algorithm used to decode the url. Found at
-//https://www.rosettacode.org/wiki/URL_decoding#C
-int ishex(int x)
+//releases all of an arena's memory
+void arenaFree(ARENA *arena)
 {
-    return (x >= '0' && x <= '9') ||
-           (x >= 'a' && x <= 'f') ||
-           (x >= 'A' && x <= 'F');
+    arenaReset(arena);
+    free(arena->current);
+    arena->current = NULL;
 }
-int decode(const char *s, char *dec)
+//appends data to a growable buffer
+void appendBuffer(BUFFER *buf, const char *data, size_t len)
 {
-    char *o;
-    const char *end = s + strlen(s);
-    int c;
-
-    for (o = dec; s <= end; o++)
+    if (buf->len + len > buf->cap)
+    {
+        size_t cap = buf->cap ? buf->cap : BUFF_SIZE;
+        while (cap < buf->len + len)
+            cap *= 2;
+        char *grown = realloc(buf->data, cap);
+        if (grown == NULL)
+            return;
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+//appends formatted text to a growable buffer
+void appendFormat(BUFFER *buf, const char *format, ...)
+{
+    char line[BUFF_SIZE];
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    appendBuffer(buf, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+}
+//queues data to be sent to the client after everything queued so far
+void appendOutput(CONNECTION *conn, const char *data, size_t len)
+{
+    size_t offset = conn->out.len;
+    if (len == 0)
+        return;
+    if (offset + len <= MAX_CONNECTION_OUTPUT)
+        appendBuffer(&conn->out, data, len);
+    if (conn->out.len != offset + len)
+    {
+        //the response is cut short, the connection cannot carry another after it
+        conn->keepAlive = 0;
+        return;
+    }
+    //extend the last segment when it already ends at this point of the buffer
+    if (conn->numSegs > 0)
+    {
+        SEGMENT *last = &conn->segs[conn->numSegs - 1];
+        if (last->fd == -1 && last->map == NULL && last->offset + last->len == (off_t)offset)
+        {
+            last->len += len;
+            return;
+        }
+    }
+    if (conn->numSegs == MAX_SEGMENTS)
+        return;
+    conn->segs[conn->numSegs].fd = -1;
+    conn->segs[conn->numSegs].offset = offset;
+    conn->segs[conn->numSegs].len = len;
+    conn->segs[conn->numSegs].map = NULL;
+    conn->numSegs++;
+}
+//blocking read of the next request. returns the number of bytes buffered, 0 when the
+//client closed the connection, stayed idle past the keep-alive timeout or did not send the
+//whole header in time
+int readrequest(CONNECTION *conn)
+{
+    int n;
+    while (requestLength(conn) == 0)
+    {
+        //wait for the next request on a persistent connection, or the rest of this one. without
+        //a header timeout the rest of a request is waited for forever
+        struct pollfd pfd = {conn->sock, POLLIN, 0};
+        int wait = conn->requestStart == 0 ? keepAliveTimeout : headerTimeout - (int)(monotonicSeconds() - conn->requestStart);
+        if (conn->requestStart != 0 && headerTimeout <= 0)
+            n = poll(&pfd, 1, -1);
+        else
+            n = poll(&pfd, 1, wait > 0 ? wait * 1000 : 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            countTimeout(conn->requestStart == 0 ? TIMEOUT_IDLE : TIMEOUT_HEADER);
+        if (n <= 0)
+            return 0;
+        //Read in from sock to buffer with size of REQUEST_BUFF_SIZE
+        // if read in value is less then 0 then print error
+        if ((n = read(conn->sock, conn->in + conn->inLen, REQUEST_BUFF_SIZE - conn->inLen)) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            perror("ERROR reading from socket");
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        requestArrived(conn, n);
+    }
+    return conn->inLen;
+}
+//takes n bytes just read into the receive buffer. the header deadline runs from the first
+//byte of a request
+void requestArrived(CONNECTION *conn, int n)
+{
+    if (conn->requestStart == 0)
+        conn->requestStart = monotonicSeconds();
+    conn->inLen += n;
+    conn->in[conn->inLen] = 0;
+}
+//the timeout a connection is waiting on and when it runs out, or -1 if it has none. a request
+//has to arrive whole within the header timeout, an idle persistent connection is kept for the
+//keep-alive timeout and a response may go for the send timeout without the client taking any
+//of it
+int connectionTimeout(CONNECTION *conn, time_t *deadline)
+{
+    if (conn->state == CONN_READING && conn->requestStart != 0)
+    {
+        *deadline = conn->requestStart + headerTimeout;
+        return headerTimeout > 0 ? TIMEOUT_HEADER : -1;
+    }
+    if (conn->state == CONN_READING)
+    {
+        *deadline = conn->lastActive + keepAliveTimeout;
+        return TIMEOUT_IDLE;
+    }
+    if (conn->state == CONN_SENDING_HEADER || conn->state == CONN_SENDING_BODY)
+    {
+        *deadline = conn->lastActive + sendTimeout;
+        return sendTimeout > 0 ? TIMEOUT_SEND : -1;
+    }
+    return -1;
+}
+//length of the first complete request in the buffer, 0 if it has not fully arrived yet,
+//-1 if it is malformed and -2 if its header does not fit in the buffer. a request is parsed
+//once, asking again for one already parsed, as its pool thread does after the event thread,
+//returns the length found then and adds nothing to its parse time
+int requestLength(CONNECTION *conn)
+{
+    if (conn->req.state == PARSE_DONE)
+        return conn->req.pos;
+    long start = monotonicNs();
+    int len = parseRequest(&conn->req, conn->in, conn->inLen);
+    conn->parseNs += monotonicNs() - start;
+    if (len == 0 && conn->inLen == REQUEST_BUFF_SIZE)
+        return -2;
+    return len;
+}
+//processes the first len bytes of the buffer as one request and removes them from it.
+//a negative length answers a request that could not be parsed and ends the connection
+void handleRequest(CONNECTION *conn, int len)
+{
+    HTTP_REQUEST *req = &conn->req;
+    int n;
+
+    conn->requests++;
+    conn->lastActive = monotonicSeconds();
+    observeLatency(STAGE_PARSE, conn->parseNs);
+    conn->parseNs = 0;
+    if (len < 0)
+    {
+        conn->keepAlive = 0;
+        if (len == -2)
+            serveErr(conn, 0, 431, "Request Header Fields Too Large", "The request header was too large");
+        else
+            serveErr(conn, 0, 400, "Bad Request", "The server could not process the request");
+        writelogStatus("", "MALFORMED REQUEST", "", len == -2 ? 431 : 400);
+        conn->inLen = 0;
+        memset(req, 0, sizeof(*req));
+        return;
+    }
+
+    //HTTP/1.1 connections persist unless the client asks otherwise, HTTP/1.0 ones only on request
+    int http10 = req->versionLen == 8 && strncmp(conn->in + req->versionOff, "HTTP/1.0", 8) == 0;
+    const char *connection = requestHeader(conn, "Connection", &n);
+    if (connection != NULL && n == 5 && strncasecmp(connection, "close", 5) == 0)
+        conn->keepAlive = 0;
+    else if (connection != NULL && n == 10 && strncasecmp(connection, "keep-alive", 10) == 0)
+        conn->keepAlive = 1;
+    else
+        conn->keepAlive = !http10;
+    //stop at the per connection cap
+    if (keepAliveRequests > 0 && conn->requests >= keepAliveRequests)
+        conn->keepAlive = 0;
+
+    processrequest(conn, len);
+
+    memmove(conn->in, conn->in + len, conn->inLen - len);
+    conn->inLen -= len;
+    conn->in[conn->inLen] = 0;
+    memset(req, 0, sizeof(*req));
+    //part of the next request may have come with this one
+    conn->requestStart = conn->inLen > 0 ? conn->lastActive : 0;
+}
+//answers every complete request in the buffer, queueing the responses in order so they can
+//go out together. stops once the connection is to be closed or enough output is queued.
+//returns the number of requests handled
+int handleRequests(CONNECTION *conn)
+{
+    int len, handled = 0;
+    while (handled < MAX_PIPELINE && conn->numSegs <= MAX_SEGMENTS - RESPONSE_SEGMENTS &&
+           conn->out.len < MAX_PIPELINE_OUTPUT && (len = requestLength(conn)) != 0)
+    {
+        handleRequest(conn, len);
+        handled++;
+        if (!conn->keepAlive)
+            break;
+    }
+    return handled;
+}
+//finds the value of a request header. returns a pointer into the receive buffer and sets its
+//length, or NULL if the request does not have the header
+const char *requestHeader(CONNECTION *conn, const char *name, int *len)
+{
+    int nameLen = strlen(name);
+    for (int i = 0; i < conn->req.numHeaders; i++)
+    {
+        HTTP_HEADER *h = &conn->req.headers[i];
+        if (h->nameLen == nameLen && strncasecmp(conn->in + h->nameOff, name, nameLen) == 0)
+        {
+            *len = h->valueLen;
+            return conn->in + h->valueOff;
+        }
+    }
+    return NULL;
+}
+//finds the first c between p and end, plain memchr where no vector unit is available
+const char *findByteScalar(const char *p, const char *end, char c)
+{
+    return memchr(p, c, end - p);
+}
+#if defined(__x86_64__) || defined(__i386__)
+//compares 32 bytes at a time
+__attribute__((target("avx2"))) const char *findByteAvx2(const char *p, const char *end, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return memchr(p, c, end - p);
+}
+//compares 16 bytes at a time, every x86-64 cpu has sse2
+__attribute__((target("sse2"))) const char *findByteSse2(const char *p, const char *end, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return memchr(p, c, end - p);
+}
+#endif
+//scanner used by the parser, picked once for the cpu we are running on
+const char *(*findByte)(const char *p, const char *end, char c) = findByteScalar;
+//picks the fastest scanner the cpu supports
+void initParser(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        findByte = findByteAvx2;
+    else if (__builtin_cpu_supports("sse2"))
+        findByte = findByteSse2;
+#endif
+}
+//resumes parsing the request in buf, one complete line at a time. headers can come in any
+//order and split across any number of reads. returns the length of the request once the blank
+//line ending it has arrived, 0 if more data is needed and -1 if it is malformed
+int parseRequest(HTTP_REQUEST *req, const char *buf, int len)
+{
+    const char *end = buf + len;
+    while (req->state == PARSE_REQUEST_LINE || req->state == PARSE_HEADERS)
+    {
+        const char *line = buf + req->pos;
+        const char *nl = findByte(line, end, '\n');
+        if (nl == NULL)
+            return 0;
+        int lineLen = nl - line;
+        if (lineLen > 0 && line[lineLen - 1] == '\r')
+            lineLen--;
+        int lineOff = req->pos;
+        req->pos = nl - buf + 1;
+
+        if (req->state == PARSE_REQUEST_LINE)
+        {
+            //method SP target SP version
+            const char *sp1 = findByte(line, line + lineLen, ' ');
+            const char *sp2 = sp1 ? findByte(sp1 + 1, line + lineLen, ' ') : NULL;
+            if (sp1 == NULL || sp2 == NULL || sp1 == line || sp2 == sp1 + 1 ||
+                line + lineLen - (sp2 + 1) < 5 || strncmp(sp2 + 1, "HTTP/", 5) != 0)
+            {
+                req->state = PARSE_ERROR;
+                break;
+            }
+            req->methodOff = lineOff;
+            req->methodLen = sp1 - line;
+            req->targetOff = sp1 + 1 - buf;
+            req->targetLen = sp2 - (sp1 + 1);
+            req->versionOff = sp2 + 1 - buf;
+            req->versionLen = line + lineLen - (sp2 + 1);
+            req->state = PARSE_HEADERS;
+        }
+        else if (lineLen == 0)
+        {
+            req->state = PARSE_DONE;
+        }
+        else
+        {
+            //name: value, with the white space around the value dropped
+            const char *colon = findByte(line, line + lineLen, ':');
+            if (colon == NULL || colon == line || req->numHeaders == MAX_HEADERS)
+            {
+                req->state = PARSE_ERROR;
+                break;
+            }
+            const char *value = colon + 1;
+            const char *valueEnd = line + lineLen;
+            while (value < valueEnd && (*value == ' ' || *value == '\t'))
+                value++;
+            while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+                valueEnd--;
+            HTTP_HEADER *h = &req->headers[req->numHeaders++];
+            h->nameOff = lineOff;
+            h->nameLen = colon - line;
+            h->valueOff = value - buf;
+            h->valueLen = valueEnd - value;
+        }
+    }
+    return (req->state == PARSE_DONE) ? req->pos : -1;
+}
+//pushes as much of the queued responses as the socket will take. runs of queued bytes are
+//gathered into one sendmsg and the socket is corked while file bodies are mixed in, so small
+//responses share packets. returns 1 when everything is sent, 0 when the socket would block
+//and -1 on error
+int progressResponse(CONNECTION *conn)
+{
+    struct iovec iov[MAX_IOVECS];
+    struct msghdr msg;
+    ssize_t n;
+    int one = 1, zero = 0;
+
+    if (conn->sendStart == 0)
+        conn->sendStart = monotonicNs();
+    if (!conn->corked && conn->numSegs - conn->curSeg > 1)
+    {
+        setsockopt(conn->sock, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+        conn->corked = 1;
+    }
+    while (conn->curSeg < conn->numSegs)
+    {
+        SEGMENT *seg = &conn->segs[conn->curSeg];
+        if (seg->fd == -1)
+        {
+            conn->state = CONN_SENDING_HEADER;
+            int count = 0;
+            for (int i = conn->curSeg; i < conn->numSegs && conn->segs[i].fd == -1 && count < MAX_IOVECS; i++)
+            {
+                iov[count].iov_base = segmentData(conn, &conn->segs[i]);
+                iov[count].iov_len = conn->segs[i].len;
+                count++;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            n = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            countSent(n);
+            advanceSegments(conn, n);
+        }
+        else
+        {
+            conn->state = CONN_SENDING_BODY;
+            if (seg->len == 0 && conn->pipeLen == 0)
+            {
+                close(seg->fd);
+                seg->fd = -1;
+                conn->curSeg++;
+                continue;
+            }
+            n = sendBody(conn, seg);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            countSent(n);
+        }
+        conn->lastActive = monotonicSeconds();
+    }
+    if (conn->curSeg < conn->numSegs)
+    {
+        //the client is not taking the responses, wait for it to make room
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        setStalled(conn, 1);
+        return 0;
+    }
+    setStalled(conn, 0);
+    if (conn->corked)
+    {
+        setsockopt(conn->sock, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+        conn->corked = 0;
+    }
+    conn->state = CONN_DONE;
+    conn->lastActive = monotonicSeconds();
+    observeLatency(STAGE_SEND, monotonicNs() - conn->sendStart);
+    conn->sendStart = 0;
+    return 1;
+}
+//steps over n bytes sent from the queued memory segments, possibly ending part way into one
+void advanceSegments(CONNECTION *conn, ssize_t n)
+{
+    while (n > 0 && conn->curSeg < conn->numSegs)
+    {
+        SEGMENT *seg = &conn->segs[conn->curSeg];
+        if (n >= seg->len)
+        {
+            n -= seg->len;
+            seg->len = 0;
+            conn->curSeg++;
+        }
+        else
+        {
+            seg->offset += n;
+            seg->len -= n;
+            n = 0;
+        }
+    }
+}
+//sends the next part of a file segment without copying it through user space. sendfile is
+//used where the file system supports it, otherwise the file is spliced through a pipe.
+//returns the number of bytes handed to the socket or -1 with errno set
+ssize_t sendBody(CONNECTION *conn, SEGMENT *seg)
+{
+    ssize_t n;
+    if (!conn->useSplice)
+    {
+        n = sendfile(conn->sock, seg->fd, &seg->offset, seg->len);
+        if (n > 0)
+        {
+            seg->len -= n;
+            return n;
+        }
+        if (n == 0)
+        {
+            //the file shrank since it was stat'd, the promised length can no longer be met
+            errno = EIO;
+            return -1;
+        }
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+        conn->useSplice = 1;
+    }
+    if (conn->pipeFds[0] == -1 && pipe2(conn->pipeFds, O_NONBLOCK) < 0)
+        return -1;
+    //fill the pipe from the file, then drain it into the socket
+    if (conn->pipeLen == 0)
+    {
+        n = splice(seg->fd, &seg->offset, conn->pipeFds[1], NULL, seg->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        conn->pipeLen = n;
+        seg->len -= n;
+    }
+    n = splice(conn->pipeFds[0], NULL, conn->sock, NULL, conn->pipeLen, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+        conn->pipeLen -= n;
+    return n;
+}
+//queues part of a file to be sent as the body of the current response. io_uring has no
+//sendfile, so there a large body is sent from the file's shared mapping rather than being
+//read through a buffer, and the descriptor is not needed
+void streamFile(CONNECTION *conn, const char *path, int fd, off_t offset, off_t size)
+{
+    MAPPING *map = NULL;
+
+    if (conn->numSegs == MAX_SEGMENTS)
+    {
+        close(fd);
+        return;
+    }
+    if (useUring && mapMinSize > 0 && size >= mapMinSize && (map = mapFile(path)) != NULL)
+    {
+        if ((size_t)(offset + size) <= map->len)
+        {
+            //start reading the part ahead of the send, page aligned
+            off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+            madvise(map->addr + start, offset + size - start < MAP_READAHEAD ? offset + size - start : MAP_READAHEAD, MADV_WILLNEED);
+            close(fd);
+            fd = -1;
+        }
+        else
+        {
+            //the file changed since it was opened, send from the descriptor
+            releaseMapping(map);
+            map = NULL;
+        }
+    }
+    conn->segs[conn->numSegs].fd = fd;
+    conn->segs[conn->numSegs].offset = offset;
+    conn->segs[conn->numSegs].len = size;
+    conn->segs[conn->numSegs].map = map;
+    conn->numSegs++;
+}
+//where the bytes of a memory segment are
+char *segmentData(CONNECTION *conn, SEGMENT *seg)
+{
+    return (seg->map != NULL ? seg->map->addr : conn->out.data) + seg->offset;
+}
+//sends the whole queued response, waiting for the client to make room as long as it keeps
+//taking some of it within the send timeout. returns 1 when everything is sent, 0 once the
+//send timeout runs out and -1 on error
+int sendResponse(CONNECTION *conn)
+{
+    time_t deadline;
+    int sent, n;
+
+    conn->state = CONN_SENDING_HEADER;
+    while ((sent = progressResponse(conn)) == 0)
+    {
+        struct pollfd pfd = {conn->sock, POLLOUT, 0};
+        int wait = -1;
+        if (connectionTimeout(conn, &deadline) >= 0 && (wait = (int)(deadline - monotonicSeconds()) * 1000) <= 0)
+            return 0;
+        if ((n = poll(&pfd, 1, wait)) < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            return 0;
+        if (n < 0)
+            return -1;
+    }
+    return sent;
+}
+//closes a connection owned by the event loop
+void closeConnection(CONNECTION **list, CONNECTION *conn)
+{
+    writelogMessage("Disconnected client IP: %s connection from event worker PID: %d", inet_ntoa(conn->addr.sin_addr), getpid());
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        *list = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    timerCancel(&conn->timer);
+    resetConnection(conn);
+    close(conn->sock);
+    releaseConnection(conn);
+    atomic_fetch_sub_explicit(&metrics->connections, 1, memory_order_relaxed);
+}
+//reads whatever the client has sent. every request that has fully arrived (or cannot be parsed)
+//is processed and the connection moves on to sending the responses
+void handleReadable(CONNECTION *conn)
+{
+    ssize_t n;
+    int eof = 0;
+    while (conn->inLen < REQUEST_BUFF_SIZE)
+    {
+        n = read(conn->sock, conn->in + conn->inLen, REQUEST_BUFF_SIZE - conn->inLen);
+        if (n > 0)
+        {
+            requestArrived(conn, n);
+        }
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        else if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            //closed by the client or a read error
+            eof = 1;
+            break;
+        }
+    }
+    //with a pool the parsed requests are handled by one of its threads, the event thread only
+    //handles them itself when every deque is full. a pool thread may take the connection as
+    //soon as it is queued, so it is not touched here after poolSubmit
+    if (pool != NULL && requestLength(conn) != 0)
+    {
+        conn->peerClosed = eof;
+        conn->state = CONN_WORKING;
+        if (poolSubmit(conn))
+            return;
+        conn->state = CONN_READING;
+    }
+    if (handleRequests(conn) > 0)
+    {
+        //nothing more will be read from a client that has gone away
+        if (eof)
+            conn->keepAlive = 0;
+        conn->state = CONN_SENDING_HEADER;
+    }
+    else if (eof)
+    {
+        conn->state = CONN_DONE;
+        conn->keepAlive = 0;
+    }
+}
+//drives a connection as far as it can go without blocking. returns 0 once it should be closed
+int driveConnection(CONNECTION *conn)
+{
+    int result;
+    while (1)
+    {
+        if (conn->state == CONN_WORKING)
+            return 1;
+        if (conn->state == CONN_READING)
+        {
+            handleReadable(conn);
+            if (conn->state == CONN_READING || conn->state == CONN_WORKING)
+                return 1;
+            if (conn->state == CONN_DONE)
+                return 0;
+        }
+        result = progressResponse(conn);
+        if (result == 0)
+            return 1;
+        if (result < 0 || !conn->keepAlive)
+            return 0;
+        //response sent, go back to reading. anything that arrived meanwhile is read straight
+        //away as no new edge will be reported for it
+        resetConnection(conn);
+    }
+}
+//event driven worker. connections are non blocking and registered edge triggered, each one
+//walks through reading -> sending header -> sending body without holding up the others
+void eventLoop(int sockfd)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    CONNECTION *connections = NULL;
+    TIMER_WHEEL wheel;
+    TIMER expired;
+    timerInit(&wheel);
+    startLogWriter();
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+    //kept so a connection can still be taken off the queue when the descriptors run out
+    int spare = open("/dev/null", O_RDONLY);
+    //the listener is shared between workers, only wake one of them per connection
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    if (poolThreads > 0)
+        poolStart(epfd);
+
+    while (1)
+    {
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        int returned = 0;
+        if (statsRequested)
+            logCacheStats();
+        sampleAcceptQueue(0);
+        expireFiles();
+        if (nfds < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < nfds; i++)
+        {
+            CONNECTION *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                //accept everything that is waiting
+                struct sockaddr_in cli_addr;
+                socklen_t len = sizeof(cli_addr);
+                int newsockfd;
+                int dropped = 0;
+                while (1)
+                {
+                    newsockfd = accept4(sockfd, (struct sockaddr *)&cli_addr, &len, SOCK_NONBLOCK);
+                    if (newsockfd < 0 && (errno == EMFILE || errno == ENFILE))
+                    {
+                        //out of descriptors. the listener stays readable while the connection
+                        //waits, so give back the ones the file cache keeps and, if that is not
+                        //enough, turn the connection away with the spare descriptor
+                        if (!dropped)
+                        {
+                            dropCachedFds();
+                            dropped = 1;
+                            continue;
+                        }
+                        if (refuseConnection(sockfd, &spare))
+                            continue;
+                    }
+                    if (newsockfd < 0)
+                        break;
+                    conn = newConnection();
+                    if (conn == NULL)
+                    {
+                        close(newsockfd);
+                        break;
+                    }
+                    initConnection(conn, newsockfd, &cli_addr);
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.ptr = conn;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0)
+                    {
+                        perror("epoll_ctl");
+                        close(newsockfd);
+                        releaseConnection(conn);
+                        continue;
+                    }
+                    conn->next = connections;
+                    if (connections != NULL)
+                        connections->prev = conn;
+                    connections = conn;
+                    armTimeout(&wheel, conn);
+                    writelogMessage("Client IP: %s connected using event worker PID: %d", inet_ntoa(cli_addr.sin_addr), getpid());
+                    len = sizeof(cli_addr);
+                }
+                continue;
+            }
+            //handed back connections are taken once the batch is done, one closed now could
+            //still have events further on in it
+            if ((void *)conn == pool)
+            {
+                returned = 1;
+                continue;
+            }
+
+            //closing the socket also removes it from the epoll set
+            if (!driveConnection(conn) || (conn->state == CONN_READING && (events[i].events & (EPOLLHUP | EPOLLERR))))
+                closeConnection(&connections, conn);
+            else
+                armTimeout(&wheel, conn);
+        }
+        if (returned)
+            poolReturned(&wheel, &connections);
+
+        //close connections that are idle, slow to send their request or not taking their
+        //responses for too long. only the timers that come due are looked at
+        time_t now = monotonicSeconds();
+        timerAdvance(&wheel, now, &expired);
+        while (expired.next != &expired)
+        {
+            CONNECTION *conn = (CONNECTION *)((char *)expired.next - offsetof(CONNECTION, timer));
+            time_t deadline;
+            timerCancel(&conn->timer);
+            int kind = connectionTimeout(conn, &deadline);
+            if (kind >= 0 && deadline <= now)
+            {
+                countTimeout(kind);
+                closeConnection(&connections, conn);
+            }
+            else
+            {
+                armTimeout(&wheel, conn);
+            }
+        }
+    }
+}
+//accepts the next waiting connection and closes it straight away, by giving up the spare
+//descriptor for it. returns 0 if there is no spare or no connection was waiting
+int refuseConnection(int sockfd, int *spare)
+{
+    if (*spare < 0)
+        return 0;
+    close(*spare);
+    int fd = accept(sockfd, NULL, NULL);
+    if (fd >= 0)
+        close(fd);
+    *spare = open("/dev/null", O_RDONLY);
+    if (fd >= 0)
+        writelogMessage("Refused a connection, event worker PID: %d is out of descriptors", getpid());
+    return fd >= 0;
+}
+//sets the connection's timer for the timeout it now waits on, or cancels it if there is none
+void armTimeout(TIMER_WHEEL *wheel, CONNECTION *conn)
+{
+    time_t deadline;
+
+    if (connectionTimeout(conn, &deadline) < 0)
+        timerCancel(&conn->timer);
+    else
+        timerSet(wheel, &conn->timer, deadline);
+}
+//empties every slot, the wheel starts at the current second
+void timerInit(TIMER_WHEEL *wheel)
+{
+    for (int level = 0; level < TIMER_LEVELS; level++)
+    {
+        for (int i = 0; i < TIMER_SLOTS; i++)
+            wheel->slots[level][i].prev = wheel->slots[level][i].next = &wheel->slots[level][i];
+    }
+    wheel->now = monotonicSeconds();
+}
+//puts a timer in the slot of the lowest level whose span reaches its expiry. one already due
+//goes in the slot of the next tick, one beyond the span of the wheel in its last slot
+void timerAdd(TIMER_WHEEL *wheel, TIMER *timer)
+{
+    unsigned long delta = timer->expires - wheel->now;
+    int level = 0;
+
+    if ((long)delta < 0)
+        delta = 0;
+    else if (delta >= 1UL << (TIMER_LEVELS * TIMER_BITS))
+        delta = (1UL << (TIMER_LEVELS * TIMER_BITS)) - 1;
+    timer->expires = wheel->now + delta;
+    while (delta >= 1UL << ((level + 1) * TIMER_BITS))
+        level++;
+    TIMER *slot = &wheel->slots[level][(timer->expires >> (level * TIMER_BITS)) & (TIMER_SLOTS - 1)];
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+}
+//sets a timer to expire at the given second, moving it if it is already set
+void timerSet(TIMER_WHEEL *wheel, TIMER *timer, unsigned long expires)
+{
+    if (timer->next != NULL && timer->expires == expires)
+        return;
+    timerCancel(timer);
+    timer->expires = expires;
+    timerAdd(wheel, timer);
+}
+//takes a timer out of the wheel, if it is in it
+void timerCancel(TIMER *timer)
+{
+    if (timer->next == NULL)
+        return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+//runs the wheel's ticks up to and including now and gathers the timers that expired in them
+//into the expired list, where they stay until cancelled or set again. each tick looks at one
+//slot, and at one of the level above whenever a level comes round
+void timerAdvance(TIMER_WHEEL *wheel, unsigned long now, TIMER *expired)
+{
+    expired->prev = expired->next = expired;
+    while ((long)(now - wheel->now) >= 0)
+    {
+        int index = wheel->now & (TIMER_SLOTS - 1);
+        //spread the next slot of the level above over the ones below
+        for (int level = 1; index == 0 && level < TIMER_LEVELS; level++)
+        {
+            int upper = (wheel->now >> (level * TIMER_BITS)) & (TIMER_SLOTS - 1);
+            TIMER *slot = &wheel->slots[level][upper];
+            TIMER *timer = slot->next;
+            slot->prev = slot->next = slot;
+            while (timer != slot)
+            {
+                TIMER *next = timer->next;
+                timerAdd(wheel, timer);
+                timer = next;
+            }
+            if (upper != 0)
+                break;
+        }
+        //move the slot of this tick onto the expired list
+        TIMER *slot = &wheel->slots[0][index];
+        if (slot->next != slot)
+        {
+            slot->next->prev = expired->prev;
+            expired->prev->next = slot->next;
+            slot->prev->next = expired;
+            expired->prev = slot->prev;
+            slot->prev = slot->next = slot;
+        }
+        wheel->now++;
+    }
+}
+//starts the pool of the calling worker. its threads hand connections back through an
+//eventfd in the worker's epoll set
+void poolStart(int epfd)
+{
+    struct epoll_event ev;
+    pthread_t thread;
+    THREAD_POOL *p = calloc(1, sizeof(THREAD_POOL));
+
+    if (p == NULL || (p->deques = calloc(poolThreads, sizeof(WORK_DEQUE))) == NULL ||
+        (p->doneFd = eventfd(0, EFD_NONBLOCK)) == -1)
+    {
+        perror("ERROR starting the thread pool");
+        exit(1);
+    }
+    p->numThreads = poolThreads;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_mutex_init(&p->doneLock, NULL);
+    for (int i = 0; i < poolThreads; i++)
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->doneFd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    //set before the threads exist so the log ring is locked from their first line
+    pool = p;
+    for (long i = 0; i < poolThreads; i++)
+    {
+        if (pthread_create(&thread, NULL, poolWorker, (void *)i) != 0)
+        {
+            perror("ERROR starting a pool thread");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    writelogMessage("Event worker PID: %d handing requests to %d threads", getpid(), poolThreads);
+}
+//queues a connection with complete requests on the next deque that has room and wakes a
+//sleeping thread. returns 0 if every deque is full
+int poolSubmit(CONNECTION *conn)
+{
+    for (int i = 0; i < pool->numThreads; i++)
+    {
+        WORK_DEQUE *d = &pool->deques[pool->next];
+        int pushed = 0;
+
+        pool->next = (pool->next + 1) % pool->numThreads;
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom - d->top < POOL_QUEUE_SIZE)
+        {
+            d->items[d->bottom++ % POOL_QUEUE_SIZE] = conn;
+            pushed = 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+        if (!pushed)
+            continue;
+        //a thread counts itself idle before it last looks at queued, so one of the two sides
+        //always sees the other
+        atomic_fetch_add(&pool->queued, 1);
+        if (atomic_load(&pool->idle) > 0)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        return 1;
+    }
+    return 0;
+}
+//takes the oldest connection from the thread's own deque or, when that is empty, steals the
+//newest from another one. NULL if there is nothing to do
+CONNECTION *poolTake(int self)
+{
+    CONNECTION *conn = NULL;
+
+    for (int i = 0; i < pool->numThreads && conn == NULL; i++)
+    {
+        WORK_DEQUE *d = &pool->deques[(self + i) % pool->numThreads];
+        pthread_mutex_lock(&d->lock);
+        if (d->bottom != d->top)
+            conn = (i == 0) ? d->items[d->top++ % POOL_QUEUE_SIZE] : d->items[--d->bottom % POOL_QUEUE_SIZE];
+        pthread_mutex_unlock(&d->lock);
+    }
+    if (conn != NULL)
+        atomic_fetch_sub(&pool->queued, 1);
+    return conn;
+}
+//a pool thread. it answers the requests of one connection at a time, handing the connection
+//back to the event thread to send the responses
+void *poolWorker(void *arg)
+{
+    int self = (long)arg;
+
+    while (1)
+    {
+        CONNECTION *conn = poolTake(self);
+        if (conn == NULL)
+        {
+            pthread_mutex_lock(&pool->lock);
+            atomic_fetch_add(&pool->idle, 1);
+            while (atomic_load(&pool->queued) == 0)
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            atomic_fetch_sub(&pool->idle, 1);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        handleRequests(conn);
+
+        //the event thread is only woken for the first of a batch
+        pthread_mutex_lock(&pool->doneLock);
+        int wake = pool->done == NULL;
+        conn->poolNext = pool->done;
+        pool->done = conn;
+        pthread_mutex_unlock(&pool->doneLock);
+        if (wake)
+        {
+            uint64_t one = 1;
+            write(pool->doneFd, &one, sizeof(one));
+        }
+    }
+    return NULL;
+}
+//sends the responses of the connections the pool has handed back and reads what arrived
+//while they were away, as no new edge will be reported for it
+void poolReturned(TIMER_WHEEL *wheel, CONNECTION **connections)
+{
+    uint64_t wakeups;
+
+    read(pool->doneFd, &wakeups, sizeof(wakeups));
+    pthread_mutex_lock(&pool->doneLock);
+    CONNECTION *conn = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->doneLock);
+    while (conn != NULL)
+    {
+        CONNECTION *next = conn->poolNext;
+        if (conn->peerClosed)
+            conn->keepAlive = 0;
+        conn->state = CONN_SENDING_HEADER;
+        if (!driveConnection(conn))
+            closeConnection(connections, conn);
+        else
+            armTimeout(wheel, conn);
+        conn = next;
+    }
+}
+//io_uring system calls, there is no libc wrapper for them
+int uringSetupCall(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+int uringEnterCall(int fd, unsigned submit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, minComplete, flags, NULL, 0);
+}
+int uringRegisterCall(int fd, unsigned opcode, void *arg, unsigned count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+//checks the kernel has io_uring and every operation the engine relies on
+int uringSupported(void)
+{
+    struct io_uring_params p;
+    struct
+    {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[256];
+    } probe;
+    int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ_FIXED,
+                    IORING_OP_WRITE_FIXED, IORING_OP_FILES_UPDATE, IORING_OP_CLOSE, IORING_OP_LINK_TIMEOUT};
+    int supported = 1;
+
+    memset(&p, 0, sizeof(p));
+    int fd = uringSetupCall(4, &p);
+    if (fd < 0)
+        return 0;
+    memset(&probe, 0, sizeof(probe));
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+        uringRegisterCall(fd, IORING_REGISTER_PROBE, &probe, 256) < 0)
+    {
+        supported = 0;
+    }
+    for (int i = 0; supported && i < (int)(sizeof(needed) / sizeof(needed[0])); i++)
+    {
+        if (needed[i] > probe.probe.last_op || !(probe.ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = 0;
+    }
+    close(fd);
+    return supported;
+}
+//creates the ring and maps its queues. registers a sparse table of fixed files for the client
+//sockets and the buffers file bodies are read into
+int uringSetup(URING *ring)
+{
+    struct io_uring_params p;
+    struct iovec iov[URING_BUFFERS];
+    int files[URING_FILES];
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 8;
+    if ((ring->fd = uringSetupCall(URING_ENTRIES, &p)) < 0)
+        return -1;
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = mmap(NULL, sqSize > cqSize ? sqSize : cqSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->buffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rings == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqHead = (unsigned *)(rings + p.sq_off.head);
+    ring->sqTail = (unsigned *)(rings + p.sq_off.tail);
+    ring->sqMask = (unsigned *)(rings + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(rings + p.sq_off.array);
+    ring->sqEntries = p.sq_entries;
+    ring->cqHead = (unsigned *)(rings + p.cq_off.head);
+    ring->cqTail = (unsigned *)(rings + p.cq_off.tail);
+    ring->cqMask = (unsigned *)(rings + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+    for (int i = 0; i < URING_BUFFERS; i++)
+    {
+        iov[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+        ring->freeBuffers[i] = i;
+    }
+    ring->numFree = URING_BUFFERS;
+    for (int i = 0; i < URING_FILES; i++)
+        files[i] = -1;
+    if (uringRegisterCall(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0 ||
+        uringRegisterCall(ring->fd, IORING_REGISTER_FILES, files, URING_FILES) < 0)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    ring->multishotAccept = uringProbeAccept(ring);
+    return 0;
+}
+//hands everything queued to the kernel and optionally waits for a completion
+int uringSubmit(URING *ring, unsigned minComplete)
+{
+    int n = uringEnterCall(ring->fd, ring->toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0);
+    if (n > 0)
+        ring->toSubmit -= n;
+    return n;
+}
+//takes the next free submission entry, submitting what is queued if the ring is full
+struct io_uring_sqe *uringSqe(URING *ring, void *data, int op)
+{
+    unsigned tail = *ring->sqTail;
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+        uringSubmit(ring, 0);
+    struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long)data | op;
+    ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+    return sqe;
+}
+//points an entry at the client socket, through the fixed file table when it is registered
+void uringSocket(struct io_uring_sqe *sqe, CONNECTION *conn)
+{
+    //sockets are registered in the slot matching their descriptor
+    sqe->fd = conn->sock;
+    if (conn->uringFixed)
+        sqe->flags |= IOSQE_FIXED_FILE;
+}
+//arms the accept on the shared listener. where the kernel has them one multishot accept keeps
+//producing connections
+void uringAccept(URING *ring, int sockfd)
+{
+    struct io_uring_sqe *sqe = uringSqe(ring, NULL, URING_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    if (ring->multishotAccept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+}
+//checks whether the kernel has multishot accepts (5.19 on) by having one take a connection to
+//a throwaway listener. older kernels reject it, and a multishot accept rejected on every rearm
+//would keep the loop spinning. the probe is cancelled once it has answered
+int uringProbeAccept(URING *ring)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int multishot = 0;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener >= 0 && client >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(listener, 1) == 0 && getsockname(listener, (struct sockaddr *)&addr, &len) == 0 &&
+        connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        struct io_uring_sqe *sqe = uringSqe(ring, NULL, URING_IGNORE);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        if (uringSubmit(ring, 1) >= 0)
+        {
+            unsigned head = *ring->cqHead;
+            if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+                multishot = cqe->res >= 0 && (cqe->flags & IORING_CQE_F_MORE);
+                if (cqe->res >= 0)
+                    close(cqe->res);
+                __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            }
+        }
+        //what the cancel and the cancelled accept complete with is ignored by the loop
+        if (multishot)
+        {
+            sqe = uringSqe(ring, NULL, URING_IGNORE);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_IGNORE;
+            uringSubmit(ring, 0);
+        }
+    }
+    if (client >= 0)
+        close(client);
+    if (listener >= 0)
+        close(listener);
+    return multishot;
+}
+//bounds the operation just queued by a linked timeout that cancels it after seconds
+void uringLinkTimeout(URING *ring, CONNECTION *conn, struct io_uring_sqe *sqe, int seconds)
+{
+    sqe->flags |= IOSQE_IO_LINK;
+    conn->uringTimeout.tv_sec = seconds > 0 ? seconds : 0;
+    conn->uringTimeout.tv_nsec = 0;
+    sqe = uringSqe(ring, conn, URING_TIMEOUT);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (unsigned long)&conn->uringTimeout;
+    sqe->len = 1;
+    conn->uringPending++;
+}
+//reads more of the request. waiting for the next request on a persistent connection, and for
+//the rest of one, is bounded by a linked timeout that cancels the read
+void uringRecv(URING *ring, CONNECTION *conn)
+{
+    struct io_uring_sqe *sqe = uringSqe(ring, conn, URING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    uringSocket(sqe, conn);
+    sqe->addr = (unsigned long)(conn->in + conn->inLen);
+    sqe->len = REQUEST_BUFF_SIZE - conn->inLen;
+    conn->uringPending = 1;
+    if (conn->requestStart == 0)
+        uringLinkTimeout(ring, conn, sqe, keepAliveTimeout);
+    else if (headerTimeout > 0)
+        uringLinkTimeout(ring, conn, sqe, headerTimeout - (int)(monotonicSeconds() - conn->requestStart));
+}
+//queues the timeout that wakes the loop a second from now, so its housekeeping runs while
+//no connection is active
+void uringTick(URING *ring)
+{
+    struct io_uring_sqe *sqe = uringSqe(ring, NULL, URING_TICK);
+    ring->tick.tv_sec = 1;
+    ring->tick.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&ring->tick;
+    sqe->len = 1;
+}
+//gives the connection's buffer back, if it has one, and carries on sending for a connection
+//that was waiting for one
+void uringReleaseBuffer(URING *ring, CONNECTION *conn)
+{
+    if (conn->uringBuf == -1)
+        return;
+    ring->freeBuffers[ring->numFree++] = conn->uringBuf;
+    conn->uringBuf = -1;
+    conn->uringBufLen = conn->uringBufSent = 0;
+    if (ring->waiting != NULL)
+    {
+        CONNECTION *next = ring->waiting;
+        ring->waiting = next->next;
+        uringSend(ring, next);
+    }
+}
+//drops the socket from the fixed file table and closes it, both from the ring
+void uringClose(URING *ring, CONNECTION *conn)
+{
+    static int noFile = -1;
+    struct io_uring_sqe *sqe;
+
+    writelogMessage("Disconnected client IP: %s connection from io_uring worker PID: %d", inet_ntoa(conn->addr.sin_addr), getpid());
+    uringReleaseBuffer(ring, conn);
+    if (conn->uringFixed)
+    {
+        sqe = uringSqe(ring, NULL, URING_IGNORE);
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long)&noFile;
+        sqe->len = 1;
+        sqe->off = conn->sock;
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    sqe = uringSqe(ring, NULL, URING_IGNORE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->sock;
+    //the socket is closed by the ring, keep resetConnection away from it
+    resetConnection(conn);
+    releaseConnection(conn);
+    atomic_fetch_sub_explicit(&metrics->connections, 1, memory_order_relaxed);
+}
+//queues the next step of sending the connection's responses. runs of queued bytes go out in
+//one sendmsg, file bodies are read into a registered buffer with a read linked to the write
+//of that buffer to the socket, so each chunk costs no system calls of its own
+void uringSend(URING *ring, CONNECTION *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (conn->sendStart == 0)
+        conn->sendStart = monotonicNs();
+    while (conn->curSeg < conn->numSegs)
+    {
+        SEGMENT *seg = &conn->segs[conn->curSeg];
+        if (seg->fd == -1 && seg->len == 0)
+        {
+            conn->curSeg++;
+            continue;
+        }
+        if (seg->fd != -1 && seg->len == 0 && conn->uringBufSent == conn->uringBufLen)
+        {
+            close(seg->fd);
+            seg->fd = -1;
+            conn->curSeg++;
+            continue;
+        }
+        break;
+    }
+    if (conn->curSeg == conn->numSegs)
+    {
+        uringReleaseBuffer(ring, conn);
+        conn->state = CONN_DONE;
+        observeLatency(STAGE_SEND, monotonicNs() - conn->sendStart);
+        conn->sendStart = 0;
+        return;
+    }
+
+    SEGMENT *seg = &conn->segs[conn->curSeg];
+    if (seg->fd == -1)
+    {
+        int count = 0;
+        conn->state = CONN_SENDING_HEADER;
+        for (int i = conn->curSeg; i < conn->numSegs && conn->segs[i].fd == -1 && count < MAX_IOVECS; i++)
+        {
+            conn->uringIov[count].iov_base = segmentData(conn, &conn->segs[i]);
+            conn->uringIov[count].iov_len = conn->segs[i].len;
+            count++;
+        }
+        memset(&conn->uringMsg, 0, sizeof(conn->uringMsg));
+        conn->uringMsg.msg_iov = conn->uringIov;
+        conn->uringMsg.msg_iovlen = count;
+        sqe = uringSqe(ring, conn, URING_SEND);
+        sqe->opcode = IORING_OP_SENDMSG;
+        uringSocket(sqe, conn);
+        sqe->addr = (unsigned long)&conn->uringMsg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        conn->uringPending = 1;
+        if (sendTimeout > 0)
+            uringLinkTimeout(ring, conn, sqe, sendTimeout);
+        return;
+    }
+
+    conn->state = CONN_SENDING_BODY;
+    if (conn->uringBuf == -1)
+    {
+        if (ring->numFree == 0)
+        {
+            //carry on once another connection is done with its buffer
+            conn->next = ring->waiting;
+            ring->waiting = conn;
+            return;
+        }
+        conn->uringBuf = ring->freeBuffers[--ring->numFree];
+        conn->uringBufLen = conn->uringBufSent = 0;
+    }
+    char *buffer = ring->buffers + (size_t)conn->uringBuf * URING_BUFFER_SIZE;
+    if (conn->uringBufSent == conn->uringBufLen)
+    {
+        //read the next chunk of the file, the write only runs if the read filled the buffer
+        conn->uringBufLen = seg->len < URING_BUFFER_SIZE ? seg->len : URING_BUFFER_SIZE;
+        conn->uringBufSent = 0;
+        sqe = uringSqe(ring, conn, URING_READ);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = seg->fd;
+        sqe->addr = (unsigned long)buffer;
+        sqe->len = conn->uringBufLen;
+        sqe->off = seg->offset;
+        sqe->buf_index = conn->uringBuf;
+        sqe->flags |= IOSQE_IO_LINK;
+        conn->uringPending = 2;
+    }
+    else
+    {
+        //the rest of a chunk the socket did not take in one go
+        conn->uringPending = 1;
+    }
+    sqe = uringSqe(ring, conn, URING_WRITE);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    uringSocket(sqe, conn);
+    sqe->addr = (unsigned long)(buffer + conn->uringBufSent);
+    sqe->len = conn->uringBufLen - conn->uringBufSent;
+    sqe->buf_index = conn->uringBuf;
+    if (sendTimeout > 0)
+        uringLinkTimeout(ring, conn, sqe, sendTimeout);
+}
+//handles a completion for a connection, moving it on once every operation in flight is done
+void uringComplete(URING *ring, CONNECTION *conn, int op, int res)
+{
+    SEGMENT *seg;
+    switch (op)
+    {
+    case URING_RECV:
+        if (res > 0)
+        {
+            requestArrived(conn, res);
+        }
+        else
+        {
+            //closed by the client, a read error or a timeout
+            conn->uringFailed = 1;
+        }
+        break;
+    case URING_TIMEOUT:
+        //the linked operation ran out of time and was cancelled
+        if (res == -ETIME)
+        {
+            conn->uringFailed = 1;
+            if (conn->state != CONN_READING)
+                countTimeout(TIMEOUT_SEND);
+            else
+                countTimeout(conn->requestStart != 0 ? TIMEOUT_HEADER : TIMEOUT_IDLE);
+        }
+        break;
+    case URING_SEND:
+        countSent(res);
+        if (res > 0)
+        {
+            //a short send means the socket filled up
+            size_t len = 0;
+            for (size_t i = 0; i < conn->uringMsg.msg_iovlen; i++)
+                len += conn->uringIov[i].iov_len;
+            setStalled(conn, (size_t)res < len);
+            advanceSegments(conn, res);
+        }
+        else
+        {
+            conn->uringFailed = 1;
+        }
+        break;
+    case URING_READ:
+        seg = &conn->segs[conn->curSeg];
+        if (res > 0)
+        {
+            //a short read breaks the link, what was read is written on the next step
+            seg->offset += res;
+            seg->len -= res;
+            conn->uringBufLen = res;
+        }
+        else
+        {
+            //an error, or the file shrank below the promised length
+            conn->uringFailed = 1;
+        }
+        break;
+    case URING_WRITE:
+        countSent(res);
+        if (res > 0)
+        {
+            conn->uringBufSent += res;
+            setStalled(conn, conn->uringBufSent < conn->uringBufLen);
+        }
+        else if (res != -ECANCELED)
+        {
+            conn->uringFailed = 1;
+        }
+        break;
+    }
+    if (--conn->uringPending > 0)
+        return;
+
+    if (conn->uringFailed)
+    {
+        uringClose(ring, conn);
+        return;
+    }
+    if (conn->state == CONN_READING)
+    {
+        if (handleRequests(conn) > 0)
+            uringSend(ring, conn);
+        else
+            uringRecv(ring, conn);
+    }
+    else
+    {
+        uringSend(ring, conn);
+    }
+    //serve the next request once the responses are out
+    while (conn->state == CONN_DONE)
+    {
+        if (!conn->keepAlive)
+        {
+            uringClose(ring, conn);
+            return;
+        }
+        resetConnection(conn);
+        if (handleRequests(conn) > 0)
+            uringSend(ring, conn);
+        else
+            uringRecv(ring, conn);
+    }
+}
+//a new connection from the multishot accept. the socket is put in the fixed file table,
+//linked ahead of the first read so the read can use it
+void uringAccepted(URING *ring, int fd)
+{
+    struct sockaddr_in cli_addr;
+    socklen_t len = sizeof(cli_addr);
+    struct io_uring_sqe *sqe;
+
+    CONNECTION *conn = newConnection();
+    if (conn == NULL)
+    {
+        close(fd);
+        return;
+    }
+    getpeername(fd, (struct sockaddr *)&cli_addr, &len);
+    initConnection(conn, fd, &cli_addr);
+    conn->uringBuf = -1;
+    writelogMessage("Client IP: %s connected using io_uring worker PID: %d", inet_ntoa(cli_addr.sin_addr), getpid());
+    if (fd < URING_FILES)
+    {
+        sqe = uringSqe(ring, NULL, URING_IGNORE);
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long)&conn->sock;
+        sqe->len = 1;
+        sqe->off = fd;
+        sqe->flags |= IOSQE_IO_LINK;
+        conn->uringFixed = 1;
+    }
+    uringRecv(ring, conn);
+}
+//io_uring worker. accepts, reads and sends are all queued on one ring and the loop makes a
+//single system call per batch to submit them and wait for completions. returns if io_uring
+//cannot be set up so the caller can fall back to another engine
+void uringLoop(int sockfd)
+{
+    URING ring;
+
+    if (uringSetup(&ring) < 0)
+    {
+        writelogMessage("Could not set up io_uring in worker PID: %d, falling back", getpid());
+        return;
+    }
+    startLogWriter();
+    uringAccept(&ring, sockfd);
+    uringTick(&ring);
+
+    while (1)
+    {
+        if (uringSubmit(&ring, 1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        if (statsRequested)
+            logCacheStats();
+        sampleAcceptQueue(0);
+        expireFiles();
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            int op = cqe->user_data & 7;
+            CONNECTION *conn = (CONNECTION *)(unsigned long)(cqe->user_data & ~7UL);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            //hand the entry back before handling it, handlers may queue more work
+            __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+
+            if (op == URING_TICK)
+            {
+                uringTick(&ring);
+            }
+            else if (op == URING_ACCEPT)
+            {
+                if (res >= 0)
+                    uringAccepted(&ring, res);
+                //out of descriptors, give back the ones the file cache is keeping
+                if (res == -EMFILE || res == -ENFILE)
+                    dropCachedFds();
+                //a finished multishot accept, or a single one, needs rearming
+                if (!(flags & IORING_CQE_F_MORE))
+                    uringAccept(&ring, sockfd);
+            }
+            else if (op != URING_IGNORE)
+            {
+                uringComplete(&ring, conn, op, res);
+            }
+        }
+    }
+}
+//sets the supported mime types from a specified mime type file
+void setMimeTypes(char *path)
+{
+    //check the mime type file here
+    if (path != NULL)
+    {
+
+        FILE *mimefile = fopen(path, "r");
+        if (mimefile != NULL)
+        {
+            char line[256];
+            //foreach line in the file add the type to the table
+            while (fgets(line, sizeof(line), mimefile) != NULL)
+            {
+                char *extension = strtok(line, " \t\r\n");
+                char *contentType = strtok(NULL, " \t\r\n");
+                //an optional third column marks types worth compressing
+                char *flag = strtok(NULL, " \t\r\n");
+                if (extension != NULL && contentType != NULL)
+                    addMime(extension, contentType, flag != NULL && strcasecmp(flag, "compress") == 0);
+            }
+            fclose(mimefile);
+            return;
+        }
+        perror(path);
+        fprintf(stderr, "Using default mimes\r\n");
+    }
+    for (int i = 0; i < (int)(sizeof(defaultMimes) / sizeof(defaultMimes[0])); i++)
+        addMime(defaultMimes[i].extension, defaultMimes[i].contentType, defaultMimes[i].compressible);
+}
+//hashes an extension, lowercasing it into lower on the way so the table is only ever compared
+//against exactly. returns -1 for an extension too long to be in the table
+int mimeHash(const char *extension, char *lower)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; extension[i]; i++)
+    {
+        if (i == MAX_LINESIZE - 1)
+            return -1;
+        lower[i] = tolower((unsigned char)extension[i]);
+        hash = (hash ^ (unsigned char)lower[i]) * 16777619u;
+    }
+    lower[i] = 0;
+    return hash & 0x7fffffff;
+}
+//adds a type to the table, replacing an earlier one for the same extension
+void addMime(const char *extension, const char *contentType, int compressible)
+{
+    char lower[MAX_LINESIZE];
+    int hash = mimeHash(extension, lower);
+
+    if (hash == -1)
+        return;
+    if (2 * (numMimes + 1) > mimeTableSize)
+    {
+        //rehash everything into a table twice the size
+        MIME *old = mimeTable;
+        int oldSize = mimeTableSize;
+        mimeTableSize = oldSize ? oldSize * 2 : MIME_TABLE_SIZE;
+        mimeTable = calloc(mimeTableSize, sizeof(MIME));
+        numMimes = 0;
+        for (int i = 0; i < oldSize; i++)
+        {
+            if (old[i].extension != NULL)
+            {
+                addMime(old[i].extension, old[i].contentType, old[i].compressible);
+                free(old[i].extension);
+                free(old[i].contentType);
+            }
+        }
+        free(old);
+    }
+    int i = hash & (mimeTableSize - 1);
+    while (mimeTable[i].extension != NULL && strcmp(mimeTable[i].extension, lower) != 0)
+        i = (i + 1) & (mimeTableSize - 1);
+    if (mimeTable[i].extension == NULL)
+    {
+        mimeTable[i].extension = strdup(lower);
+        numMimes++;
+    }
+    else
+    {
+        free(mimeTable[i].contentType);
+    }
+    mimeTable[i].contentType = strdup(contentType);
+    mimeTable[i].compressible = compressible;
+}
+//looks up the type of an extension, NULL if it is not supported
+MIME *findMime(const char *extension)
+{
+    char lower[MAX_LINESIZE];
+    int hash = mimeHash(extension, lower);
+
+    if (hash == -1 || mimeTable == NULL)
+        return NULL;
+    for (int i = hash & (mimeTableSize - 1); mimeTable[i].extension != NULL; i = (i + 1) & (mimeTableSize - 1))
+    {
+        if (strcmp(mimeTable[i].extension, lower) == 0)
+            return &mimeTable[i];
+    }
+    return NULL;
+}
+//the formatted log date, only rebuilt when the second changes, per thread
+const char *logTimestamp(void)
+{
+    static __thread time_t cachedTime = 0;
+    static __thread char cached[64];
+    struct tm p;
+
+    time_t t = time(NULL);
+    if (t != cachedTime)
+    {
+        localtime_r(&t, &p);
+        strftime(cached, sizeof(cached), "%a, %d %b %Y %H:%M:%S %Z", &p);
+        cachedTime = t;
+    }
+    return cached;
+}
+//writes out everything waiting in the ring in one go
+void flushLogRing(LOG_RING *ring)
+{
+    struct iovec iov[2];
+    char note[BUFF_SIZE];
+    int count = 0;
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (tail != head)
+    {
+        //the waiting lines may wrap around the end of the ring
+        size_t start = head % LOG_RING_SIZE;
+        size_t len = tail - head;
+        size_t first = (len < LOG_RING_SIZE - start) ? len : LOG_RING_SIZE - start;
+        iov[count].iov_base = ring->data + start;
+        iov[count++].iov_len = first;
+        if (first < len)
+        {
+            iov[count].iov_base = ring->data;
+            iov[count++].iov_len = len - first;
+        }
+        while (count > 0)
+        {
+            ssize_t n = writev(logfd, iov, count);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            //carry on after a partial write
+            while (count > 0 && (size_t)n >= iov[0].iov_len)
+            {
+                n -= iov[0].iov_len;
+                iov[0] = iov[1];
+                count--;
+            }
+            if (count > 0)
+            {
+                iov[0].iov_base = (char *)iov[0].iov_base + n;
+                iov[0].iov_len -= n;
+            }
+        }
+        atomic_store_explicit(&ring->head, tail, memory_order_release);
+    }
+    if (dropped > 0)
+    {
+        int n = snprintf(note, sizeof(note), "[ %s ] [ INFO ] %lu log lines dropped by PID: %d \r\n", logTimestamp(), dropped, getpid());
+        write(logfd, note, n);
+    }
+}
+//writer thread of a worker, drains the ring every flush interval or sooner when woken
+void *logWriter(void *arg)
+{
+    LOG_RING *ring = arg;
+    struct pollfd pfd = {ring->wakefd, POLLIN, 0};
+    uint64_t wakeups;
+
+    while (1)
+    {
+        if (poll(&pfd, 1, logFlushInterval) > 0)
+            read(ring->wakefd, &wakeups, sizeof(wakeups));
+        flushLogRing(ring);
+    }
+    return NULL;
+}
+//gives the calling worker its own log ring and writer thread. has to run after forking as
+//threads do not survive fork()
+void startLogWriter(void)
+{
+    pthread_t thread;
+    LOG_RING *ring;
+
+    if (logRing != NULL)
+        return;
+    if ((ring = calloc(1, sizeof(LOG_RING))) == NULL)
+        return;
+    pthread_mutex_init(&ring->lock, NULL);
+    if ((ring->wakefd = eventfd(0, EFD_NONBLOCK)) == -1)
+    {
+        free(ring);
+        return;
+    }
+    if (pthread_create(&thread, NULL, logWriter, ring) != 0)
+    {
+        close(ring->wakefd);
+        free(ring);
+        return;
+    }
+    pthread_detach(thread);
+    logRing = ring;
+}
+//queues a formatted line for the writer thread. before a worker has one, or if the line could
+//never fit, it is written straight away. when the ring is full the line is counted and dropped
+//rather than holding up the request
+void writelogLine(const char *line, size_t len)
+{
+    LOG_RING *ring = logRing;
+    if (ring == NULL || len > LOG_RING_SIZE)
+    {
+        write(logfd, line, len);
+        return;
+    }
+    //the threads of a pool share their worker's ring
+    int shared = pool != NULL;
+    if (shared)
+        pthread_mutex_lock(&ring->lock);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (LOG_RING_SIZE - (tail - head) < len)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        if (shared)
+            pthread_mutex_unlock(&ring->lock);
+        return;
+    }
+    size_t start = tail % LOG_RING_SIZE;
+    size_t first = (len < LOG_RING_SIZE - start) ? len : LOG_RING_SIZE - start;
+    memcpy(ring->data + start, line, first);
+    memcpy(ring->data, line + first, len - first);
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+    if (shared)
+        pthread_mutex_unlock(&ring->lock);
+
+    //wake the writer as the backlog crosses the flush size
+    if (tail - head < (size_t)logFlushSize && tail + len - head >= (size_t)logFlushSize)
+    {
+        uint64_t one = 1;
+        write(ring->wakefd, &one, sizeof(one));
+    }
+}
+//writes an info message to the log file using a simple formatter and date
+void writelogMessage(char *message, ...)
+{
+    va_list arg;
+    char line[BUFF_SIZE * 2];
+    char buffer[BUFF_SIZE];
+
+    va_start(arg, message);
+    vsnprintf(buffer, sizeof(buffer), message, arg);
+    va_end(arg);
+
+    int n = snprintf(line, sizeof(line), "[ %s ] [ INFO ] %s \r\n", logTimestamp(), buffer);
+    writelogLine(line, (n < (int)sizeof(line)) ? n : (int)sizeof(line) - 1);
+}
+//writes the status to the log file. contains the method, host, resource, status
+void writelogStatus(char *method, char *host, char *resource, int status)
+{
+    char line[BUFF_SIZE * 2];
+
+    int n = snprintf(line, sizeof(line), "[ %s ] %s %s %s %d\r\n", logTimestamp(), method, host, resource, status);
+    writelogLine(line, (n < (int)sizeof(line)) ? n : (int)sizeof(line) - 1);
+    countRequest(method, status);
+}
+//maps the counters every worker adds to, before any worker is forked
+void metricsInit(int numListeners)
+{
+    static METRICS privateMetrics;
+
+    metrics = mmap(NULL, sizeof(METRICS), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED)
+        metrics = &privateMetrics;
+    memset(metrics, 0, sizeof(METRICS));
+    metrics->numListeners = numListeners < METRICS_LISTENERS ? numListeners : METRICS_LISTENERS;
+}
+long monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+//seconds on a clock that does not jump with the time of day, cheap enough for every event
+time_t monotonicSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+//adds one observation to a stage's histogram
+void observeLatency(int stage, long ns)
+{
+    LATENCY *l = &metrics->stages[stage];
+    int i = 0;
+
+    while (i < LATENCY_BUCKETS && ns > latencyBounds[i])
+        i++;
+    atomic_fetch_add_explicit(&l->buckets[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&l->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&l->sumNs, ns, memory_order_relaxed);
+}
+//counts an answered request
+void countRequest(const char *method, int status)
+{
+    int m = strcmp(method, "GET") == 0 ? 0 : strcmp(method, "HEAD") == 0 ? 1 : strcmp(method, "TRACE") == 0 ? 2 : 3;
+    int i = 0;
+
+    while (i < METRIC_STATUSES - 1 && statusLines[i].status != status)
+        i++;
+    atomic_fetch_add_explicit(&metrics->requests[m][i], 1, memory_order_relaxed);
+}
+//counts bytes handed to a socket
+void countSent(ssize_t n)
+{
+    if (n > 0)
+        atomic_fetch_add_explicit(&metrics->bytesSent, n, memory_order_relaxed);
+}
+//counts a connection closed for taking too long
+void countTimeout(int kind)
+{
+    atomic_fetch_add_explicit(&metrics->timeouts[kind], 1, memory_order_relaxed);
+}
+//marks whether the client has stopped taking the connection's responses
+void setStalled(CONNECTION *conn, int stalled)
+{
+    if (conn->stalled == stalled)
+        return;
+    conn->stalled = stalled;
+    atomic_fetch_add_explicit(&metrics->stalled, stalled ? 1 : -1, memory_order_relaxed);
+}
+//publishes how many connections wait on this worker's listener, at most once a second
+//unless forced. the kernel reports a listener's accept queue in tcpi_unacked and its
+//limit in tcpi_sacked
+void sampleAcceptQueue(int force)
+{
+    static __thread time_t lastSample = 0;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    time_t now = time(NULL);
+
+    if ((!force && now == lastSample) || listenSock == -1 || listenIndex >= metrics->numListeners)
+        return;
+    lastSample = now;
+    if (getsockopt(listenSock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return;
+    atomic_store_explicit(&metrics->acceptQueue[listenIndex], info.tcpi_unacked, memory_order_relaxed);
+    atomic_store_explicit(&metrics->acceptLimit[listenIndex], info.tcpi_sacked, memory_order_relaxed);
+}
+//answers with every counter in the text exposition format
+void serveMetrics(CONNECTION *conn, int headOnly)
+{
+    const char *methods[METRIC_METHODS] = {"GET", "HEAD", "TRACE", "other"};
+    BUFFER body = {0};
+
+    sampleAcceptQueue(1);
+    appendFormat(&body, "# HELP myhttpd_requests_total Requests answered, by method and status.\n"
+                "# TYPE myhttpd_requests_total counter\n");
+    for (int m = 0; m < METRIC_METHODS; m++)
+    {
+        for (int i = 0; i < METRIC_STATUSES; i++)
+        {
+            unsigned long count = atomic_load_explicit(&metrics->requests[m][i], memory_order_relaxed);
+            if (count == 0)
+                continue;
+            if (i < METRIC_STATUSES - 1)
+                appendFormat(&body, "myhttpd_requests_total{method=\"%s\",status=\"%d\"} %lu\n", methods[m], statusLines[i].status, count);
+            else
+                appendFormat(&body, "myhttpd_requests_total{method=\"%s\",status=\"other\"} %lu\n", methods[m], count);
+        }
+    }
+    appendFormat(&body, "# HELP myhttpd_sent_bytes_total Bytes handed to client sockets.\n"
+                "# TYPE myhttpd_sent_bytes_total counter\n"
+                "myhttpd_sent_bytes_total %lu\n",
+                atomic_load(&metrics->bytesSent));
+    appendFormat(&body, "# HELP myhttpd_connections_accepted_total Connections accepted.\n"
+                "# TYPE myhttpd_connections_accepted_total counter\n"
+                "myhttpd_connections_accepted_total %lu\n",
+                atomic_load(&metrics->accepted));
+    appendFormat(&body, "# HELP myhttpd_connections_active Connections currently open.\n"
+                "# TYPE myhttpd_connections_active gauge\n"
+                "myhttpd_connections_active %ld\n",
+                atomic_load(&metrics->connections));
+    appendFormat(&body, "# HELP myhttpd_connections_stalled Connections whose client is not taking their responses.\n"
+                "# TYPE myhttpd_connections_stalled gauge\n"
+                "myhttpd_connections_stalled %ld\n",
+                atomic_load(&metrics->stalled));
+    appendFormat(&body, "# HELP myhttpd_timeouts_total Connections closed for taking too long, by what they were doing.\n"
+                "# TYPE myhttpd_timeouts_total counter\n");
+    for (int i = 0; i < NUM_TIMEOUTS; i++)
+        appendFormat(&body, "myhttpd_timeouts_total{kind=\"%s\"} %lu\n", timeoutNames[i], atomic_load(&metrics->timeouts[i]));
+    appendFormat(&body, "# HELP myhttpd_accept_queue_length Connections waiting to be accepted, by listener.\n"
+                "# TYPE myhttpd_accept_queue_length gauge\n");
+    for (int i = 0; i < metrics->numListeners; i++)
+        appendFormat(&body, "myhttpd_accept_queue_length{listener=\"%d\"} %d\n", i, atomic_load(&metrics->acceptQueue[i]));
+    appendFormat(&body, "# HELP myhttpd_accept_queue_limit Most connections that may wait, by listener.\n"
+                "# TYPE myhttpd_accept_queue_limit gauge\n");
+    for (int i = 0; i < metrics->numListeners; i++)
+        appendFormat(&body, "myhttpd_accept_queue_limit{listener=\"%d\"} %d\n", i, atomic_load(&metrics->acceptLimit[i]));
+    appendFormat(&body, "# HELP myhttpd_stage_duration_seconds Time spent in each stage of serving a request.\n"
+                "# TYPE myhttpd_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < NUM_STAGES; stage++)
+    {
+        LATENCY *l = &metrics->stages[stage];
+        unsigned long cumulative = 0;
+        for (int i = 0; i <= LATENCY_BUCKETS; i++)
+        {
+            cumulative += atomic_load_explicit(&l->buckets[i], memory_order_relaxed);
+            if (i < LATENCY_BUCKETS)
+                appendFormat(&body, "myhttpd_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", stageNames[stage], latencyBounds[i] / 1e9, cumulative);
+            else
+                appendFormat(&body, "myhttpd_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stageNames[stage], cumulative);
+        }
+        appendFormat(&body, "myhttpd_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stageNames[stage], atomic_load(&l->sumNs) / 1e9);
+        appendFormat(&body, "myhttpd_stage_duration_seconds_count{stage=\"%s\"} %lu\n", stageNames[stage], cumulative);
+    }
+
+    writeHeader(conn, 200, "OK", "text/plain; version=0.0.4", body.len);
+    if (!headOnly)
+        appendOutput(conn, body.data, body.len);
+    free(body.data);
+}
+
+//process the parsed request at the start of the receive buffer
+void processrequest(CONNECTION *conn, int len)
+{
+    HTTP_REQUEST *req = &conn->req;
+    char method[16];
+    char host[MAX_LINESIZE];
+    //the resource is copied so it can be handed on as a string
+    char *resource = arenaAlloc(&conn->arena, req->targetLen + 1);
+    int n;
+
+    //only the start of an overly long method is needed to tell it is unsupported
+    n = req->methodLen < (int)sizeof(method) ? req->methodLen : (int)sizeof(method) - 1;
+    memcpy(method, conn->in + req->methodOff, n);
+    method[n] = 0;
+    if (resource == NULL)
+    {
+        serveErr(conn, 0, 500, "Internal Server Error", "The server encountered an internal error");
+        writelogStatus(method, "", "", 500);
+        return;
+    }
+    memcpy(resource, conn->in + req->targetOff, req->targetLen);
+    resource[req->targetLen] = 0;
+
+    //make sure the host is actually available, otherwise return nothing
+    const char *hostValue = requestHeader(conn, "Host", &n);
+    if (hostValue == NULL)
+    {
+        serveErr(conn, 0, 400, "Bad Request", "The server could not process the request");
+        writelogStatus(method, "NO HOST PROVIDED", "", 400);
+        return;
+    }
+    if (n >= (int)sizeof(host))
+        n = sizeof(host) - 1;
+    memcpy(host, hostValue, n);
+    host[n] = 0;
+
+    if (strcasecmp(method, "GET") == 0)
+    {
+        request(conn, resource, host, 0);
+    }
+    else if (strcasecmp(method, "TRACE") == 0)
+    {
+        //send the request back to the client
+        trace(conn, resource, host, conn->in, len);
+    }
+    else if (strcasecmp(method, "HEAD") == 0)
+    {
+        request(conn, resource, host, 1);
+    }
+    else
+    {
+        //method not supported
+        serveErr(conn, 0, 405, "Method Not Allowed", "The server could not process the requested method");
+
+        writelogStatus(method, host, resource, 405);
+    }
+}
+//formats the header fields describing a body. a negative content length leaves the length out
+int entityHeader(char *buffer, char *contentType, long contentLength)
+{
+    if (contentLength >= 0)
+        return sprintf(buffer, "Content-Type: %s\r\nContent-Length: %ld\r\n", contentType, contentLength);
+    return sprintf(buffer, "Content-Type: %s\r\n", contentType);
+}
+//maps the shared Date and renders the status line of every status the server sends
+void headerInit(void)
+{
+    static HTTP_DATE privateDate;
+
+    httpNow = mmap(NULL, sizeof(HTTP_DATE), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (httpNow == MAP_FAILED)
+        httpNow = &privateDate;
+    memset(httpNow, 0, sizeof(HTTP_DATE));
+    for (size_t i = 0; i < sizeof(statusLines) / sizeof(statusLines[0]); i++)
+    {
+        STATUS_LINE *l = &statusLines[i];
+        l->len = sprintf(l->line, "HTTP/1.1 %d %s\r\nDate: ", l->status, l->message);
+    }
+}
+//the Date field's value for now, formatted at most once a second across all workers
+const char *currentDate(void)
+{
+    time_t now = time(NULL);
+
+    if (atomic_load(&httpNow->second) != now)
+    {
+        int next = !atomic_load(&httpNow->current);
+        httpDate(now, httpNow->value[next]);
+        atomic_store(&httpNow->current, next);
+        atomic_store(&httpNow->second, now);
+    }
+    return httpNow->value[atomic_load(&httpNow->current)];
+}
+//queues a status line and the date around already formatted header fields, copied from the
+//templates into one piece of the output so it leaves with the body in the same sendmsg
+void writeHeaderFields(CONNECTION *conn, int status, char *statusMessage, const char *fields, size_t len)
+{
+    long start = monotonicNs();
+    static const char keepAlive[] = "Connection: keep-alive\r\n\r\n";
+    static const char close[] = "Connection: close\r\n\r\n";
+    //room for the longest status line, the Date field, the fields and the Connection field
+    char buffer[96 + HTTP_DATE_SIZE + 2 + len + sizeof(keepAlive)];
+    char *p = buffer;
+    size_t i = 0;
+
+    while (i < sizeof(statusLines) / sizeof(statusLines[0]) && statusLines[i].status != status)
+        i++;
+    if (i < sizeof(statusLines) / sizeof(statusLines[0]))
+    {
+        memcpy(p, statusLines[i].line, statusLines[i].len);
+        p += statusLines[i].len;
+    }
+    else
+    {
+        p += snprintf(p, 96, "HTTP/1.1 %d %.48s\r\nDate: ", status, statusMessage);
+    }
+    memcpy(p, currentDate(), HTTP_DATE_SIZE);
+    memcpy(p + HTTP_DATE_SIZE, "\r\n", 2);
+    p += HTTP_DATE_SIZE + 2;
+    memcpy(p, fields, len);
+    p += len;
+    if (conn->keepAlive)
+    {
+        memcpy(p, keepAlive, sizeof(keepAlive) - 1);
+        p += sizeof(keepAlive) - 1;
+    }
+    else
+    {
+        memcpy(p, close, sizeof(close) - 1);
+        p += sizeof(close) - 1;
+    }
+    appendOutput(conn, buffer, p - buffer);
+    observeLatency(STAGE_HEADER, monotonicNs() - start);
+}
+//queues the response header. a negative content length means the body runs until the connection closes
+void writeHeader(CONNECTION *conn, int status, char *statusMessage, char *contentType, long contentLength)
+{
+    char buffer[BUFF_SIZE];
+    int len = entityHeader(buffer, contentType, contentLength);
+
+    if (contentLength < 0)
+        conn->keepAlive = 0;
+    writeHeaderFields(conn, status, statusMessage, buffer, len);
+}
+//algorithm used to decode the url. Found at
+//https://www.rosettacode.org/wiki/URL_decoding#C
+int ishex(int x)
+{
+    return (x >= '0' && x <= '9') ||
+           (x >= 'a' && x <= 'f') ||
+           (x >= 'A' && x <= 'F');
+}
+int decode(const char *s, char *dec)
+{
+    char *o;
+    const char *end = s + strlen(s);
+    int c;
+
+    for (o = dec; s <= end; o++)
     {
         c = *s++;
         if (c == '+')
@@ -413,155 +3443,886 @@ int decode(const char *s, char *dec)
                               !sscanf(s - 2, "%2x", &c)))
             return -1;
 
-        if (dec)
-            *o = c;
+        if (dec)
+            *o = c;
+    }
+
+    return o - dec;
+}
+//does eithe ra GET or HEAD request and returns the whole body or just teh header based on the head only varialbe
+void request(CONNECTION *conn, char *resource, char *host, int headOnly)
+{
+    //the query only matters to directory listings
+    char *query = strchr(resource, '?');
+    if (query != NULL)
+        *query++ = 0;
+
+    char *method = (headOnly) ? "HEAD" : "GET";
+    if (strcmp(resource, METRICS_PATH) == 0)
+    {
+        serveMetrics(conn, headOnly);
+        writelogStatus(method, host, resource, 200);
+        return;
+    }
+    //the url is decoded once, to remove any special characters such as %20, into the path
+    //relative to the document root that everything below works with
+    char *rpath = arenaAlloc(&conn->arena, strlen(resource) + 2);
+    if (rpath == NULL)
+    {
+        serveErr(conn, headOnly, 500, "Internal Server Error", "The server encountered an internal error");
+        writelogStatus(method, host, resource, 500);
+        return;
+    }
+    rpath[0] = '.';
+    if (decode(resource, rpath + 1) < 0)
+    {
+        serveErr(conn, headOnly, 400, "Bad Request", "The server could not process the request");
+        writelogStatus(method, host, resource, 400);
+        return;
+    }
+
+    FILE_ENTRY fileEntry;
+    FILE_ENTRY *file = lookupFile(rpath, &fileEntry);
+    if (file != NULL && S_ISDIR(file->st.st_mode))
+    {
+        processDirectory(conn, resource, rpath, query, host, headOnly, &file->st);
+    }
+    else if (file != NULL && S_ISREG(file->st.st_mode))
+    {
+        processFile(conn, resource, rpath, host, headOnly, file);
+    }
+    else if (file != NULL)
+    {
+        //cant process
+        serveErr(conn, headOnly, 400, "Bad Request", "The server could not process the request");
+        writelogStatus(method, host, resource, 400);
+    }
+    else
+    {
+        serveErr(conn, headOnly, 404, "Not Found", "The server could not locate the requested resource");
+
+        writelogStatus(method, host, resource, 404);
+    }
+}
+
+//serves an error message based on the type of status. each page is rendered once per worker
+//and then only copied
+void serveErr(CONNECTION *conn, int headOnly, int statusCode, char *statusType, char *message)
+{
+    ERROR_PAGE scratch;
+    ERROR_PAGE *page = NULL;
+
+    for (int i = 0; i < numErrorPages && page == NULL; i++)
+    {
+        if (errorPages[i].status == statusCode && strcmp(errorPages[i].message, message) == 0)
+            page = &errorPages[i];
+    }
+    if (page == NULL)
+    {
+        page = numErrorPages < MAX_ERROR_PAGES ? &errorPages[numErrorPages++] : &scratch;
+        page->status = statusCode;
+        page->message = message;
+        page->bodyLen = snprintf(page->body, sizeof(page->body),
+                                 "<!DOCTYPE HTML>\r\n"
+                                 "<html>\r\n"
+                                 " <head>\r\n"
+                                 "  <title>%d %s</title>\r\n"
+                                 " </head>\r\n"
+                                 " <body>\r\n"
+                                 "  <h1>%s</h1>\r\n"
+                                 "  <p>%s<p>\r\n"
+                                 " </body>\r\n"
+                                 "</html>\r\n",
+                                 statusCode, statusType, statusType, message);
+        if (page->bodyLen >= (int)sizeof(page->body))
+            page->bodyLen = sizeof(page->body) - 1;
+        page->fieldsLen = entityHeader(page->fields, "text/html", page->bodyLen);
+    }
+    writeHeaderFields(conn, statusCode, statusType, page->fields, page->fieldsLen);
+    if (!headOnly)
+    {
+        appendOutput(conn, page->body, page->bodyLen);
+    }
+}
+//maps the shared content cache. size is split between the block data and its usage map
+void cacheInit(size_t size)
+{
+    int numBlocks = size / (CACHE_BLOCK_SIZE + 1);
+    size_t total = sizeof(CACHE) + numBlocks + (size_t)numBlocks * CACHE_BLOCK_SIZE;
+    pthread_mutexattr_t attr;
+
+    if (numBlocks == 0)
+        return;
+    CACHE *c = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED)
+    {
+        perror("ERROR mapping the content cache");
+        return;
+    }
+    //the lock is shared between processes and recovers if a worker dies holding it
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&c->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    c->numBlocks = numBlocks;
+    c->maxObject = size / 8 < MAX_BUFFERED_BODY ? size / 8 : MAX_BUFFERED_BODY;
+    c->blockUsed = (unsigned char *)(c + 1);
+    c->data = (char *)c->blockUsed + numBlocks;
+    cache = c;
+    cacheClear();
+    writelogMessage("Using a %lu KB content cache", (unsigned long)(size / 1024));
+}
+//empties the cache. the lock must be held
+void cacheClear(void)
+{
+    for (int i = 0; i < CACHE_BUCKETS; i++)
+        cache->buckets[i] = -1;
+    for (int i = 0; i < CACHE_ENTRIES; i++)
+    {
+        cache->entries[i].key[0] = 0;
+        cache->entries[i].hashNext = (i + 1 < CACHE_ENTRIES) ? i + 1 : -1;
+    }
+    memset(cache->blockUsed, 0, cache->numBlocks);
+    cache->freeEntry = 0;
+    cache->lruHead = cache->lruTail = -1;
+    cache->bytesUsed = 0;
+}
+//takes the cache lock. if its last owner died part way through an update the cache is emptied
+void cacheLock(void)
+{
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD)
+    {
+        cacheClear();
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+//FNV-1a hash of a cache key
+unsigned int cacheHash(const char *key)
+{
+    unsigned int hash = 2166136261u;
+    while (*key)
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    return hash % CACHE_BUCKETS;
+}
+//finds the entry for a key, -1 if there is none
+int cacheFind(const char *key)
+{
+    for (int i = cache->buckets[cacheHash(key)]; i != -1; i = cache->entries[i].hashNext)
+    {
+        if (strcmp(cache->entries[i].key, key) == 0)
+            return i;
+    }
+    return -1;
+}
+//unlinks an entry from the least recently used list
+void cacheLruUnlink(int i)
+{
+    CACHE_ENTRY *e = &cache->entries[i];
+    if (e->lruPrev != -1)
+        cache->entries[e->lruPrev].lruNext = e->lruNext;
+    else
+        cache->lruHead = e->lruNext;
+    if (e->lruNext != -1)
+        cache->entries[e->lruNext].lruPrev = e->lruPrev;
+    else
+        cache->lruTail = e->lruPrev;
+}
+//makes an entry the most recently used one
+void cacheLruPush(int i)
+{
+    CACHE_ENTRY *e = &cache->entries[i];
+    e->lruPrev = -1;
+    e->lruNext = cache->lruHead;
+    if (cache->lruHead != -1)
+        cache->entries[cache->lruHead].lruPrev = i;
+    cache->lruHead = i;
+    if (cache->lruTail == -1)
+        cache->lruTail = i;
+}
+//removes an entry and frees its blocks
+void cacheRemove(int i)
+{
+    CACHE_ENTRY *e = &cache->entries[i];
+    int *link = &cache->buckets[cacheHash(e->key)];
+    while (*link != i)
+        link = &cache->entries[*link].hashNext;
+    *link = e->hashNext;
+    cacheLruUnlink(i);
+    memset(cache->blockUsed + e->firstBlock, 0, e->numBlocks);
+    cache->bytesUsed -= e->headerLen + e->bodyLen;
+    e->key[0] = 0;
+    e->hashNext = cache->freeEntry;
+    cache->freeEntry = i;
+}
+//finds a run of free blocks, first fit. returns the first block or -1
+int cacheAllocBlocks(int count)
+{
+    int run = 0;
+    for (int i = 0; i < cache->numBlocks; i++)
+    {
+        run = cache->blockUsed[i] ? 0 : run + 1;
+        if (run == count)
+        {
+            memset(cache->blockUsed + i - count + 1, 1, count);
+            return i - count + 1;
+        }
+    }
+    return -1;
+}
+//queues a cached response if there is a current one for the key. returns 1 on a hit
+int cacheFetch(CONNECTION *conn, const char *key, struct stat *st, int status, char *statusMessage, int headOnly)
+{
+    int hit = 0;
+    if (cache == NULL)
+        return 0;
+    cacheLock();
+    int i = cacheFind(key);
+    if (i != -1)
+    {
+        CACHE_ENTRY *e = &cache->entries[i];
+        if (e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+            e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec)
+        {
+            char *data = cache->data + (size_t)e->firstBlock * CACHE_BLOCK_SIZE;
+            writeHeaderFields(conn, status, statusMessage, data, e->headerLen);
+            if (!headOnly)
+                appendOutput(conn, data + e->headerLen, e->bodyLen);
+            cacheLruUnlink(i);
+            cacheLruPush(i);
+            cache->hits++;
+            hit = 1;
+        }
+        else
+        {
+            //the file has changed since it was cached
+            cacheRemove(i);
+            cache->invalidations++;
+        }
+    }
+    if (!hit)
+        cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+//stores a response under a key, evicting the least recently used entries to make room
+void cacheStore(const char *key, struct stat *st, const char *header, size_t headerLen, const char *body, size_t bodyLen)
+{
+    size_t len = headerLen + bodyLen;
+    int count = (len + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+    int first;
+
+    if (cache == NULL || len > cache->maxObject || strlen(key) >= MAX_PATHSIZE)
+        return;
+    if (count == 0)
+        count = 1;
+    cacheLock();
+    int i = cacheFind(key);
+    if (i != -1)
+        cacheRemove(i);
+    while (cache->freeEntry == -1 || (first = cacheAllocBlocks(count)) == -1)
+    {
+        if (cache->lruTail == -1)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return;
+        }
+        cacheRemove(cache->lruTail);
+        cache->evictions++;
+    }
+    i = cache->freeEntry;
+    CACHE_ENTRY *e = &cache->entries[i];
+    cache->freeEntry = e->hashNext;
+
+    strcpy(e->key, key);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->headerLen = headerLen;
+    e->bodyLen = bodyLen;
+    e->firstBlock = first;
+    e->numBlocks = count;
+    char *data = cache->data + (size_t)first * CACHE_BLOCK_SIZE;
+    memcpy(data, header, headerLen);
+    memcpy(data + headerLen, body, bodyLen);
+
+    unsigned int bucket = cacheHash(key);
+    e->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+    cacheLruPush(i);
+    cache->bytesUsed += len;
+    cache->stores++;
+    pthread_mutex_unlock(&cache->lock);
+}
+//writes the cache counters to the log
+void logCacheStats(void)
+{
+    statsRequested = 0;
+    if (cache == NULL)
+    {
+        writelogMessage("Content cache disabled");
+        return;
+    }
+    cacheLock();
+    unsigned long hits = cache->hits, misses = cache->misses, stores = cache->stores;
+    unsigned long evictions = cache->evictions, invalidations = cache->invalidations;
+    size_t used = cache->bytesUsed;
+    pthread_mutex_unlock(&cache->lock);
+    writelogMessage("Content cache: %lu hits, %lu misses, %lu stores, %lu evictions, %lu invalidations, %lu bytes used",
+                    hits, misses, stores, evictions, invalidations, (unsigned long)used);
+}
+//reads a whole small file into the cache and queues it as the response
+int cacheFile(CONNECTION *conn, const char *key, int fd, struct stat *st, char *contentType, int vary, int headOnly)
+{
+    char header[BUFF_SIZE];
+    char *body;
+    ssize_t n;
+    size_t got = 0;
+
+    if (cache == NULL || st->st_size > (off_t)cache->maxObject)
+        return 0;
+    if ((body = arenaAlloc(&conn->arena, st->st_size + 1)) == NULL)
+        return 0;
+    while (got < (size_t)st->st_size && (n = pread(fd, body + got, st->st_size - got, got)) > 0)
+        got += n;
+    if (got != (size_t)st->st_size)
+        return 0;
+    int headerLen = fileHeader(header, contentType, st->st_size, st, ENCODING_IDENTITY, vary);
+    cacheStore(key, st, header, headerLen, body, got);
+    writeHeaderFields(conn, 200, "OK", header, headerLen);
+    if (!headOnly)
+        appendOutput(conn, body, got);
+    close(fd);
+    return 1;
+}
+//formats a time as an HTTP date
+void httpDate(time_t t, char *buffer)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buffer, 64, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+//reads an HTTP date from a header value. returns -1 if it is not one
+int parseHttpDate(const char *value, int len, time_t *t)
+{
+    char buffer[64];
+    struct tm tm;
+
+    if (len >= (int)sizeof(buffer))
+        return -1;
+    memcpy(buffer, value, len);
+    buffer[len] = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(buffer, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return -1;
+    *t = timegm(&tm);
+    return 0;
+}
+//name of a content coding
+const char *encodingName(int encoding)
+{
+    return encoding == ENCODING_BR ? "br" : encoding == ENCODING_GZIP ? "gzip" : encoding == ENCODING_DEFLATE ? "deflate" : "identity";
+}
+//the entity tag of a file, changing whenever the file is replaced or modified. every coding
+//of the file is a different representation with a tag of its own
+void fileETag(struct stat *st, int encoding, char *etag)
+{
+    int len = sprintf(etag, "\"%lx-%lx-%lx%05lx", (unsigned long)st->st_ino, (unsigned long)st->st_size,
+                      (unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec >> 12);
+    if (encoding != ENCODING_IDENTITY)
+        len += sprintf(etag + len, "-%s", encodingName(encoding));
+    strcpy(etag + len, "\"");
+}
+//formats the header fields clients use to revalidate and resume a file
+int fileValidators(char *buffer, struct stat *st, int encoding)
+{
+    char date[64];
+    char etag[64];
+
+    httpDate(st->st_mtime, date);
+    fileETag(st, encoding, etag);
+    return sprintf(buffer, "Last-Modified: %s\r\nETag: %s\r\nAccept-Ranges: bytes\r\n", date, etag);
+}
+//formats the coding of a body, and whether it depends on the Accept-Encoding of the request
+int codingHeader(char *buffer, int encoding, int vary)
+{
+    int len = 0;
+    buffer[0] = 0;
+    if (encoding != ENCODING_IDENTITY)
+        len += sprintf(buffer, "Content-Encoding: %s\r\n", encodingName(encoding));
+    if (vary || encoding != ENCODING_IDENTITY)
+        len += sprintf(buffer + len, "Vary: Accept-Encoding\r\n");
+    return len;
+}
+//formats the header fields of a whole file in the given coding
+int fileHeader(char *buffer, char *contentType, long contentLength, struct stat *st, int encoding, int vary)
+{
+    int len = entityHeader(buffer, contentType, contentLength);
+    len += codingHeader(buffer + len, encoding, vary);
+    return len + fileValidators(buffer + len, st, encoding);
+}
+//checks an If-None-Match list for the entity tag. weak tags match too, as the comparison is weak
+int etagListMatches(const char *list, int len, const char *etag)
+{
+    const char *end = list + len;
+    int etagLen = strlen(etag);
+
+    while (list < end)
+    {
+        while (list < end && (*list == ' ' || *list == '\t' || *list == ','))
+            list++;
+        if (list < end && *list == '*')
+            return 1;
+        if (end - list > 2 && strncmp(list, "W/", 2) == 0)
+            list += 2;
+        if (end - list >= etagLen && strncmp(list, etag, etagLen) == 0)
+            return 1;
+        while (list < end && *list != ',')
+            list++;
     }
+    return 0;
+}
+//whether the conditional headers say the client's copy of the file is current
+int notModified(CONNECTION *conn, struct stat *st, const char *etag)
+{
+    int len;
+    time_t since;
+    const char *value = requestHeader(conn, "If-None-Match", &len);
 
-    return o - dec;
+    //If-Modified-Since only counts when there is no entity tag to go by
+    if (value != NULL)
+        return etagListMatches(value, len, etag);
+    value = requestHeader(conn, "If-Modified-Since", &len);
+    return value != NULL && parseHttpDate(value, len, &since) == 0 && st->st_mtime <= since;
 }
-//does eithe ra GET or HEAD request and returns the whole body or just teh header based on the head only varialbe
-void request(int sock, char *resource, char *host, int headOnly)
+//reads a decimal position of a byte range. returns -1 if there is none or it is too large
+off_t rangePosition(const char **p, const char *end)
 {
+    off_t value = 0;
+    const char *start = *p;
 
-    // char buffer[BUFF_SIZE];
-    long n;
-    // int file_fd;
-    //check for directory requests
-    struct stat s;
-    char *method = (headOnly) ? "HEAD" : "GET";
-    //get relative path of resource
-    char *rpath = (char *)malloc(1 + strlen(".") + strlen(resource));
-    //to hold the decoded resource
-    char decoded[strlen(resource) + 1];
+    while (*p < end && **p >= '0' && **p <= '9')
+    {
+        if (value > (off_t)(LLONG_MAX / 10) - 1)
+            return -1;
+        value = value * 10 + (*(*p)++ - '0');
+    }
+    return *p == start ? -1 : value;
+}
+//works out the byte ranges a request wants of a file. returns the number of ranges, 0 to send
+//the whole file, when the request has no usable Range or its If-Range does not match, or -1
+//if none of the ranges overlap the file
+int requestedRanges(CONNECTION *conn, struct stat *st, const char *etag, off_t *starts, off_t *ends)
+{
+    int len, ifRangeLen, count = 0, specs = 0;
+    time_t date;
+    const char *p = requestHeader(conn, "Range", &len);
 
-    //need to decode the url to remove any special characters such as %20
-    decode(resource, decoded);
-    //reate a relative path
-    strcpy(rpath, ".");
-    strcat(rpath, decoded);
+    if (p == NULL || len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return 0;
+    //If-Range asks for the ranges only if the file is still the one it has part of
+    const char *ifRange = requestHeader(conn, "If-Range", &ifRangeLen);
+    if (ifRange != NULL)
+    {
+        if (ifRange[0] == '"' ? (ifRangeLen != (int)strlen(etag) || strncmp(ifRange, etag, ifRangeLen) != 0)
+                              : (parseHttpDate(ifRange, ifRangeLen, &date) != 0 || date != st->st_mtime))
+        {
+            return 0;
+        }
+    }
 
-    // fprintf(stderr, "%s", rpath);
-    if (stat(rpath, &s) == 0)
+    const char *end = p + len;
+    p += 6;
+    while (p < end)
     {
-        //directory
-        if (s.st_mode & S_IFDIR)
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+        off_t first = rangePosition(&p, end), last;
+        if (p == end || *p != '-')
+            return 0;
+        p++;
+        last = rangePosition(&p, end);
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if ((p < end && *p != ',') || (first == -1 && last == -1) || (first != -1 && last != -1 && last < first))
+            return 0;
+        specs++;
+        if (first == -1)
         {
-            //process directory
-            processDirectory(sock, resource, host, headOnly);
+            //a suffix, the last bytes of the file
+            if (last == 0 || st->st_size == 0)
+                continue;
+            first = st->st_size > last ? st->st_size - last : 0;
+            last = st->st_size - 1;
         }
-        else if (s.st_mode & S_IFREG)
+        else
         {
-            //file
-            processFile(sock, resource, host, headOnly);
+            if (first >= st->st_size)
+                continue;
+            if (last == -1 || last >= st->st_size)
+                last = st->st_size - 1;
         }
+        if (count == MAX_RANGES)
+            return 0;
+        starts[count] = first;
+        ends[count] = last;
+        count++;
+    }
+    if (specs == 0)
+        return 0;
+    return count > 0 ? count : -1;
+}
+//queues a 206 response with byte ranges of a file. one range is sent as it is, several as the
+//parts of a multipart/byteranges body. the parts are all sent straight from the file, or its
+//mapping
+void serveRanges(CONNECTION *conn, const char *path, int fd, struct stat *st, char *contentType, off_t *starts, off_t *ends, int count, int headOnly)
+{
+    char fields[BUFF_SIZE];
+    char parts[MAX_RANGES][BUFF_SIZE];
+    int partLens[MAX_RANGES];
+    char closing[64];
+    char type[BUFF_SIZE];
+    char boundary[32];
+    int len;
+
+    if (count == 1)
+    {
+        len = entityHeader(fields, contentType, ends[0] - starts[0] + 1);
+        len += sprintf(fields + len, "Content-Range: bytes %ld-%ld/%ld\r\n", (long)starts[0], (long)ends[0], (long)st->st_size);
+        len += fileValidators(fields + len, st, ENCODING_IDENTITY);
+        writeHeaderFields(conn, 206, "Partial Content", fields, len);
+        if (!headOnly)
+            streamFile(conn, path, fd, starts[0], ends[0] - starts[0] + 1);
         else
+            close(fd);
+        return;
+    }
+
+    //every part has a header of its own, they are formatted first to know the length of the body
+    sprintf(boundary, "%08lx%08lx%08lx", (unsigned long)st->st_ino, (unsigned long)st->st_mtim.tv_nsec, (unsigned long)time(NULL));
+    long total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        partLens[i] = sprintf(parts[i], "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                              boundary, contentType, (long)starts[i], (long)ends[i], (long)st->st_size);
+        total += partLens[i] + ends[i] - starts[i] + 1;
+    }
+    len = sprintf(closing, "\r\n--%s--\r\n", boundary);
+    total += len;
+    sprintf(type, "multipart/byteranges; boundary=%s", boundary);
+    writeHeaderFields(conn, 206, "Partial Content", fields, fileHeader(fields, type, total, st, ENCODING_IDENTITY, 0));
+    if (headOnly)
+    {
+        close(fd);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        //each part owns a descriptor, so each can be closed once it has been sent
+        int partFd = i == 0 ? fd : dup(fd);
+        if (partFd == -1)
         {
-            //cant process
-            serveErr(sock, headOnly, 400, "Bad Request", "The server could not process the request");
-            writelogStatus(method, host, resource, 400);
+            //the body is cut short, the connection can not carry on after it
+            conn->keepAlive = 0;
+            return;
         }
+        appendOutput(conn, parts[i], partLens[i]);
+        streamFile(conn, path, partFd, starts[i], ends[i] - starts[i] + 1);
     }
-    else
+    appendOutput(conn, closing, len);
+}
+//works out the content codings the request accepts. codings given a q of 0 are refused
+int acceptedEncodings(CONNECTION *conn)
+{
+    int len, accepted = 0;
+    const char *p = requestHeader(conn, "Accept-Encoding", &len);
+
+    if (p == NULL)
+        return 0;
+    const char *end = p + len;
+    while (p < end)
     {
-        //anything else
-        //fprintf(stdout, "Error locating resource");
-        serveErr(sock, headOnly, 404, "Not Found", "The server could not locate the requested resource");
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        int nameLen = p - name, coding = 0;
+        if (nameLen == 4 && strncasecmp(name, "gzip", 4) == 0)
+            coding = ENCODING_GZIP;
+        else if (nameLen == 7 && strncasecmp(name, "deflate", 7) == 0)
+            coding = ENCODING_DEFLATE;
+        else if (nameLen == 2 && strncasecmp(name, "br", 2) == 0)
+            coding = ENCODING_BR;
+        else if (nameLen == 1 && *name == '*')
+            coding = ENCODING_GZIP | ENCODING_DEFLATE | ENCODING_BR;
+        //a weight of zero, however written, refuses the coding
+        const char *q = p;
+        while (q < end && *q != ',' && *q != 'q')
+            q++;
+        if (q + 2 < end && q[1] == '=' && strtod(q + 2, NULL) == 0)
+            coding = 0;
+        accepted |= coding;
+        while (p < end && *p != ',')
+            p++;
+    }
+    return accepted;
+}
+//picks the content coding of a file's body. a precompressed .br or .gz sibling at least as new
+//as the file comes first, setting its path in variant. otherwise compressible types of a
+//worthwhile size are compressed here, with the best coding the client accepts
+int chooseEncoding(CONNECTION *conn, const char *path, struct stat *st, int compressible, char *variant, int *precompressed)
+{
+    int accepted = acceptedEncodings(conn);
+    FILE_ENTRY variantEntry, *variantFile;
+    const char *suffixes[] = {".br", ".gz"};
+    int codings[] = {ENCODING_BR, ENCODING_GZIP};
 
-        writelogStatus(method, host, resource, 404);
+    *precompressed = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (!(accepted & codings[i]))
+            continue;
+        sprintf(variant, "%s%s", path, suffixes[i]);
+        if ((variantFile = lookupFile(variant, &variantEntry)) != NULL && S_ISREG(variantFile->st.st_mode) &&
+            variantFile->st.st_mtime >= st->st_mtime)
+        {
+            *precompressed = 1;
+            return codings[i];
+        }
     }
-    free(rpath);
+    if (!compressible || st->st_size < MIN_COMPRESS_SIZE || st->st_size > MAX_COMPRESS_SIZE)
+        return ENCODING_IDENTITY;
+    return preferredEncoding(accepted);
+}
+//the best of the accepted codings
+int preferredEncoding(int accepted)
+{
+    if (accepted & ENCODING_BR)
+        return ENCODING_BR;
+    if (accepted & ENCODING_GZIP)
+        return ENCODING_GZIP;
+    if (accepted & ENCODING_DEFLATE)
+        return ENCODING_DEFLATE;
+    return ENCODING_IDENTITY;
 }
+//compresses a body in one go. returns the compressed body, allocated from the arena, or NULL
+char *compressBody(ARENA *arena, const char *body, size_t len, int encoding, size_t *outLen)
+{
+    char *out;
 
-//serves an error message based on the type of status
-void serveErr(int sock, int headOnly, int statusCode, char *statusType, char *message)
+    if (encoding == ENCODING_BR)
+    {
+        *outLen = BrotliEncoderMaxCompressedSize(len);
+        if (*outLen == 0 || (out = arenaAlloc(arena, *outLen)) == NULL)
+            return NULL;
+        if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len,
+                                   (const uint8_t *)body, outLen, (uint8_t *)out))
+            return NULL;
+        return out;
+    }
+
+    //gzip and deflate are the same stream with a gzip or a zlib wrapper
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, encoding == ENCODING_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    *outLen = deflateBound(&zs, len);
+    if ((out = arenaAlloc(arena, *outLen)) == NULL)
+    {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = *outLen;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    *outLen = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+//reads a whole file, compresses it and queues it as the response. the compressed response is
+//cached under a key naming the coding, validated against the file like any other entry.
+//returns 0 if it could not be compressed
+int compressFile(CONNECTION *conn, const char *key, int fd, struct stat *st, char *contentType, int encoding, int headOnly)
 {
-    char buffer[BUFF_SIZE];
+    char header[BUFF_SIZE];
+    char *body, *compressed;
+    ssize_t n;
+    size_t got = 0, len;
 
-    writeHeader(sock, statusCode, statusType, "text/html");
+    if ((body = arenaAlloc(&conn->arena, st->st_size + 1)) == NULL)
+        return 0;
+    while (got < (size_t)st->st_size && (n = pread(fd, body + got, st->st_size - got, got)) > 0)
+        got += n;
+    if (got != (size_t)st->st_size || (compressed = compressBody(&conn->arena, body, got, encoding, &len)) == NULL)
+        return 0;
+    int headerLen = fileHeader(header, contentType, len, st, encoding, 1);
+    cacheStore(key, st, header, headerLen, compressed, len);
+    writeHeaderFields(conn, 200, "OK", header, headerLen);
     if (!headOnly)
+        appendOutput(conn, compressed, len);
+    close(fd);
+    return 1;
+}
+//queues a generated 200 response in the given coding, if it is worth compressing. with a key
+//the response is also cached, validated against st
+void writeCompressible(CONNECTION *conn, const char *key, struct stat *st, char *contentType, const char *body, size_t len, int encoding, int headOnly)
+{
+    char fields[BUFF_SIZE];
+    char *compressed = NULL;
+    size_t compressedLen;
+
+    if (encoding != ENCODING_IDENTITY && len >= MIN_COMPRESS_SIZE && (compressed = compressBody(&conn->arena, body, len, encoding, &compressedLen)) != NULL)
     {
-        sprintf(buffer, "<!DOCTYPE HTML>\r\n"
-                        "<html>\r\n"
-                        " <head>\r\n"
-                        "  <title>%d %s</title>\r\n"
-                        " </head>\r\n"
-                        " <body>\r\n"
-                        "  <h1>Bad Request</h1>\r\n"
-                        "  <p>%s<p>\r\n"
-                        " </body>\r\n"
-                        "</html>\r\n",
-                statusCode, statusType, message);
-        write(sock, buffer, strlen(buffer));
+        body = compressed;
+        len = compressedLen;
     }
+    else
+    {
+        encoding = ENCODING_IDENTITY;
+    }
+    int fieldsLen = entityHeader(fields, contentType, len);
+    fieldsLen += codingHeader(fields + fieldsLen, encoding, 1);
+    if (key != NULL)
+        cacheStore(key, st, fields, fieldsLen, body, len);
+    writeHeaderFields(conn, 200, "OK", fields, fieldsLen);
+    if (!headOnly)
+        appendOutput(conn, body, len);
 }
 //does the file processing
-void processFile(int sock, char *resource, char *host, int headOnly)
+void processFile(CONNECTION *conn, char *resource, char *rpath, char *host, int headOnly, FILE_ENTRY *file)
 {
-    long n;
-    char buffer[BUFF_SIZE];
     char *method = (headOnly) ? "HEAD" : "GET";
     int file_fd;
-    char *rpath = (char *)malloc(1 + strlen(".") + strlen(resource));
-    char decoded[strlen(resource) + 1];
-    //decode the url
-    decode(resource, decoded);
-    //create relative path
-    strcpy(rpath, ".");
-    strcat(rpath, decoded);
-    // fprintf(stdout, "it's a file");
+    //what is needed of the entry is kept here
+    struct stat fileSt = file->st;
+    struct stat *st = &fileSt;
 
     //get the extension using the strchr call.
     char *ext = strrchr(resource, '.');
     char *contentType = NULL;
+    int compressible = 0;
     if (!ext)
     {
         //no extension
-        serveErr(sock, headOnly, 400, "Bad Request", "The server could not process the request");
+        serveErr(conn, headOnly, 400, "Bad Request", "The server could not process the request");
         writelogStatus(method, host, resource, 400);
         return;
     }
-    else
+    else if (file->mime != NULL)
     {
-        for (int i = 0; i < numMimes; i++)
-        {
-            //check if the extension exsits in the supported mime type
-            if (strcasecmp(ext + 1, mimes[i].extension) == 0)
-            {
-                contentType = mimes[i].contentType;
-                break;
-            }
-        }
+        //the supported mime type was resolved when the file was opened
+        contentType = file->mime->contentType;
+        compressible = file->mime->compressible;
     }
     //in mime type found
     if (contentType != NULL)
     {
-        if ((file_fd = open(rpath, O_RDONLY)) == -1)
-        {
-            serveErr(sock, headOnly, 500, "Internal Server Error", "The server encountered an internal error");
+        char etag[64];
+        char fields[BUFF_SIZE];
+        off_t starts[MAX_RANGES], ends[MAX_RANGES];
+        char *variant = arenaAlloc(&conn->arena, strlen(rpath) + 4);
+        char *key = arenaAlloc(&conn->arena, strlen(rpath) + 16);
+        int encoding = ENCODING_IDENTITY, precompressed = 0, len;
 
+        if (variant == NULL || key == NULL)
+        {
+            serveErr(conn, headOnly, 500, "Internal Server Error", "The server encountered an internal error");
             writelogStatus(method, host, resource, 500);
+            return;
         }
-        writeHeader(sock, 200, "OK", contentType);
-        //write the rest of the data if not a HEAD request
-        if (!headOnly)
+
+        //ranges are always of the file as it is, otherwise the body may be sent compressed
+        if (requestHeader(conn, "Range", &len) == NULL)
+            encoding = chooseEncoding(conn, rpath, st, compressible, variant, &precompressed);
+        fileETag(st, encoding, etag);
+        //the client's copy is still current
+        if (notModified(conn, st, etag))
         {
-            while ((n = read(file_fd, buffer, BUFF_SIZE)) > 0)
-            {
-                write(sock, buffer, n);
-            }
+            len = codingHeader(fields, ENCODING_IDENTITY, compressible || encoding != ENCODING_IDENTITY);
+            writeHeaderFields(conn, 304, "Not Modified", fields, len + fileValidators(fields + len, st, encoding));
+            writelogStatus(method, host, resource, 304);
+            return;
+        }
+        int numRanges = requestedRanges(conn, st, etag, starts, ends);
+        if (numRanges < 0)
+        {
+            int len = sprintf(fields, "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n", (long)st->st_size);
+            writeHeaderFields(conn, 416, "Range Not Satisfiable", fields, len);
+            writelogStatus(method, host, resource, 416);
+            return;
+        }
+        //a precompressed sibling is sent as it is, described by the file it was made from
+        struct stat variantSt;
+        if (precompressed && (file_fd = openFile(variant, &variantSt)) != -1)
+        {
+            writeHeaderFields(conn, 200, "OK", fields, fileHeader(fields, contentType, variantSt.st_size, st, encoding, 1));
+            if (!headOnly)
+                streamFile(conn, variant, file_fd, 0, variantSt.st_size);
+            else
+                close(file_fd);
+            writelogStatus(method, host, resource, 200);
+            return;
+        }
+        if (precompressed)
+            encoding = ENCODING_IDENTITY;
+        //every coding of a file is cached under its own key
+        if (encoding != ENCODING_IDENTITY)
+            sprintf(key, "%s;%s", rpath, encodingName(encoding));
+        else
+            strcpy(key, rpath);
+        //hot small files are served straight from the shared cache, which only holds whole responses
+        if (numRanges == 0 && cacheFetch(conn, key, st, 200, "OK", headOnly))
+        {
+            writelogStatus(method, host, resource, 200);
+            return;
         }
+        struct stat statbuf;
+        if ((file_fd = openFile(rpath, &statbuf)) == -1)
+        {
+            serveErr(conn, headOnly, 500, "Internal Server Error", "The server encountered an internal error");
 
-        writelogStatus(method, host, resource, 200);
+            writelogStatus(method, host, resource, 500);
+            return;
+        }
+        if (numRanges > 0)
+        {
+            serveRanges(conn, rpath, file_fd, &statbuf, contentType, starts, ends, numRanges, headOnly);
+            writelogStatus(method, host, resource, 206);
+        }
+        else if (encoding != ENCODING_IDENTITY && compressFile(conn, key, file_fd, &statbuf, contentType, encoding, headOnly))
+        {
+            //compressed and queued
+        }
+        else if (!cacheFile(conn, rpath, file_fd, &statbuf, contentType, compressible, headOnly))
+        {
+            writeHeaderFields(conn, 200, "OK", fields, fileHeader(fields, contentType, statbuf.st_size, &statbuf, ENCODING_IDENTITY, compressible));
+            //the rest of the data is streamed from the file if not a HEAD request
+            if (!headOnly)
+                streamFile(conn, rpath, file_fd, 0, statbuf.st_size);
+            else
+                close(file_fd);
+        }
+        if (numRanges == 0)
+            writelogStatus(method, host, resource, 200);
     }
     else
     {
         //mime type not supported
-        serveErr(sock, headOnly, 415, "Unsupported Media Type", "The requested resource is unsupported");
+        serveErr(conn, headOnly, 415, "Unsupported Media Type", "The requested resource is unsupported");
 
         writelogStatus(method, host, resource, 415);
     }
-
-    free(rpath);
 }
 //converts a byte to a readable format. extracted from
 //http://programanddesign.com/cpp/human-readable-file-size-in-c/
@@ -577,212 +4338,549 @@ char* readable_fs(double size/*in bytes*/, char *buf) {
     return buf;
 }
 //processes the directory request
-void processDirectory(int sock, char *resource, char *host, int headOnly)
+//reads a parameter of a listing's query into value. returns 0 if the query does not have it
+int queryParam(const char *query, const char *name, char *value, int size)
 {
-    long n;
-    char buffer[BUFF_SIZE];
-    int file_fd;
-    struct stat statbuf;
-    char m_time[32], size[16];
+    int nameLen = strlen(name);
+    for (const char *p = query; p != NULL && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL)
+    {
+        if (strncmp(p, name, nameLen) == 0 && p[nameLen] == '=')
+        {
+            int len = strcspn(p + nameLen + 1, "&");
+            if (len >= size)
+                len = size - 1;
+            memcpy(value, p + nameLen + 1, len);
+            value[len] = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+//orders listing entries by the column the sort points at, breaking ties by name
+int compareEntries(const void *a, const void *b, void *sort)
+{
+    const LISTING_ENTRY *x = a, *y = b;
+    int c = 0;
+    switch (*(char *)sort)
+    {
+    case 's':
+        c = (x->size > y->size) - (x->size < y->size);
+        break;
+    case 't':
+        c = (x->mtime > y->mtime) - (x->mtime < y->mtime);
+        break;
+    }
+    return c ? c : strcmp(x->name, y->name);
+}
+//serves a page of a directory's listing, sorted on the column the query asks for. rendered
+//pages are kept in the content cache in every coding sent, and dropped when the directory's
+//mtime shows entries were added, removed or renamed. returns the status sent
+int serveListing(CONNECTION *conn, char *rpath, char *basePath, char *query, int headOnly)
+{
+    char buffer[BUFF_SIZE + 2 * NAME_MAX];
+    char sort[8] = "name", order[8] = "asc", pageParam[16];
+    char m_time[32], size[32];
+    struct stat dirSt, st;
+    int page = 1;
 
-    //check for directory requests
-    char *method = (headOnly) ? "HEAD" : "GET";
-    //get relative path of resource
-    char *rpath = (char *)malloc(1 + strlen(".") + strlen(resource));
-    //decode the resource and construct a relative path
-    char decoded[strlen(resource) + 1];
-    decode(resource, decoded);
-    strcpy(rpath, ".");
-    strcat(rpath, decoded);
-    //calculate the base path
-    char *basePath = (char *)malloc(1 + strlen("//") + strlen(resource));
-    strcpy(basePath, resource);
-    char *tmp = (char *)malloc(1 + BUFF_SIZE + strlen(basePath));
-    //if there is no trailing slash, add one to the base path
-    if (resource[strlen(resource) - 1] != '/')
-    {
-        strcat(basePath, "/");
+    queryParam(query, "sort", sort, sizeof(sort));
+    queryParam(query, "order", order, sizeof(order));
+    if (queryParam(query, "page", pageParam, sizeof(pageParam)))
+        page = atoi(pageParam);
+    if (strcmp(sort, "size") != 0 && strcmp(sort, "time") != 0)
+        strcpy(sort, "name");
+    if (strcmp(order, "desc") != 0)
+        strcpy(order, "asc");
+    if (page < 1)
+        page = 1;
+
+    DIR *dir = opendir(rpath);
+    if (dir == NULL || fstat(dirfd(dir), &dirSt) == -1)
+    {
+        perror("Couldn't open the directory");
+        if (dir != NULL)
+            closedir(dir);
+        serveErr(conn, headOnly, 500, "Internal Server Error", "The server encountered an internal error");
+        return 500;
     }
-    //check for parent directory requests.
-    if (strstr(rpath, "..") != NULL)
+    int encoding = preferredEncoding(acceptedEncodings(conn));
+    char *key = arenaAlloc(&conn->arena, strlen(rpath) + 64);
+    if (key == NULL)
     {
-        //cannot process parent directory from root requets
-        serveErr(sock, headOnly, 400, "Bad Request", "The server could not process the request");
+        closedir(dir);
+        serveErr(conn, headOnly, 500, "Internal Server Error", "The server encountered an internal error");
+        return 500;
+    }
+    sprintf(key, "%s?sort=%s&order=%s&page=%d;%s", rpath, sort, order, page, encodingName(encoding));
+    if (cacheFetch(conn, key, &dirSt, 200, "OK", headOnly))
+    {
+        closedir(dir);
+        return 200;
+    }
 
-        writelogStatus(method, host, resource, 400);
+    //the entries are stat'd relative to the directory without being opened. they and their
+    //names live in the arena, which drops the outgrown arrays with everything else
+    LISTING_ENTRY *entries = NULL;
+    int numEntries = 0, capacity = 0;
+    struct dirent *dirListing;
+    while ((dirListing = readdir(dir)) != NULL)
+    {
+        //skip the . and .. listings
+        if (!strcmp(dirListing->d_name, ".") || !strcmp(dirListing->d_name, ".."))
+            continue;
+        if (fstatat(dirfd(dir), dirListing->d_name, &st, 0) == -1)
+        {
+            perror(dirListing->d_name);
+            continue;
+        }
+        //only files and directories are listed
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+            continue;
+        size_t nameLen = strlen(dirListing->d_name) + 1;
+        char *name = arenaAlloc(&conn->arena, nameLen);
+        if (numEntries == capacity)
+        {
+            LISTING_ENTRY *grown = arenaAlloc(&conn->arena, (capacity ? capacity * 2 : 64) * sizeof(LISTING_ENTRY));
+            if (grown == NULL)
+                break;
+            if (numEntries > 0)
+                memcpy(grown, entries, numEntries * sizeof(LISTING_ENTRY));
+            entries = grown;
+            capacity = capacity ? capacity * 2 : 64;
+        }
+        if (name == NULL)
+            break;
+        memcpy(name, dirListing->d_name, nameLen);
+        entries[numEntries].name = name;
+        entries[numEntries].isDir = S_ISDIR(st.st_mode);
+        entries[numEntries].size = st.st_size;
+        entries[numEntries].mtime = st.st_mtime;
+        numEntries++;
     }
-    else
+    closedir(dir);
+    if (numEntries > 0)
+        qsort_r(entries, numEntries, sizeof(LISTING_ENTRY), compareEntries, sort);
+
+    int pages = numEntries ? (numEntries + LISTING_PAGE_SIZE - 1) / LISTING_PAGE_SIZE : 1;
+    if (page > pages)
+        page = pages;
+    int first = (page - 1) * LISTING_PAGE_SIZE;
+    int last = first + LISTING_PAGE_SIZE < numEntries ? first + LISTING_PAGE_SIZE : numEntries;
+
+    //the page is rendered into one buffer, sent with the header in a single write. the paths
+    //in its head are as long as the request allows, so it is sized to fit them
+    BUFFER listing = {NULL, 0, 0};
+    const char *head = "<!DOCTYPE html>\r\n"
+                    "<html>\r\n"
+                    " <head>\r\n"
+                    "  <meta charset='utf-8'>\r\n"
+                    "  <title>Directory Listing</title>\r\n"
+                    "  <base href='%s'>\r\n"
+                    "  <style>\r\n"
+                    "   td,th{padding: 0 20px 0 0; text-align: left;}\r\n"
+                    "  </style>\r\n"
+                    " </head>\r\n"
+                    " <body>\r\n"
+                    "  <h1>Directory listing for %s</h1>\r\n"
+                    "  <table>\r\n"
+                    "   <tr><th><a href=\"?sort=name&order=%s\">Name</a></th><th><a href=\"?sort=time&order=%s\">Last modified</a></th>"
+                    "<th><a href=\"?sort=size&order=%s\">Size</a></th></tr>\r\n";
+    const char *nameOrder = !strcmp(sort, "name") && !strcmp(order, "asc") ? "desc" : "asc";
+    const char *timeOrder = !strcmp(sort, "time") && !strcmp(order, "asc") ? "desc" : "asc";
+    const char *sizeOrder = !strcmp(sort, "size") && !strcmp(order, "asc") ? "desc" : "asc";
+    char headText[snprintf(NULL, 0, head, basePath, rpath, nameOrder, timeOrder, sizeOrder) + 1];
+    int headLen = sprintf(headText, head, basePath, rpath, nameOrder, timeOrder, sizeOrder);
+    appendBuffer(&listing, headText, headLen);
+    for (int i = first; i < last; i++)
     {
-        file_fd = -1;
+        LISTING_ENTRY *e = &entries[strcmp(order, "desc") ? i : numEntries - 1 - i];
+        //display the time
+        struct tm mtm;
+        strftime(m_time, sizeof(m_time), "%Y-%m-%d %H:%M", localtime_r(&e->mtime, &mtm));
+        //no need to get the size if its a directory
+        if (e->isDir)
+            strcpy(size, "[DIR]");
+        else
+            readable_fs(e->size, size);
+        //serve it as a table
+        int len = sprintf(buffer, "   <tr><td><a href=\"%s%s\">%s%s</a></td><td>%s</td><td>%s</td></tr>\r\n",
+                          e->name, e->isDir ? "/" : "", e->name, e->isDir ? "/" : "", m_time, size);
+        appendBuffer(&listing, buffer, len);
+    }
+    //no files, just serve a blank table
+    if (numEntries == 0)
+        appendBuffer(&listing, "   <tr><td>No files found</td></tr>\r\n", strlen("   <tr><td>No files found</td></tr>\r\n"));
+    appendBuffer(&listing, "  </table>\r\n", strlen("  </table>\r\n"));
+    if (pages > 1)
+    {
+        int len = sprintf(buffer, "  <p>Page %d of %d", page, pages);
+        if (page > 1)
+            len += sprintf(buffer + len, " <a href=\"?sort=%s&order=%s&page=%d\">Previous</a>", sort, order, page - 1);
+        if (page < pages)
+            len += sprintf(buffer + len, " <a href=\"?sort=%s&order=%s&page=%d\">Next</a>", sort, order, page + 1);
+        len += sprintf(buffer + len, "</p>\r\n");
+        appendBuffer(&listing, buffer, len);
+    }
+    appendBuffer(&listing, " </body>\r\n</html>\r\n", strlen(" </body>\r\n</html>\r\n"));
 
-        //try to open index.html -> index.htm -> default.htm else show the directory lisiting
+    writeCompressible(conn, key, &dirSt, "text/html", listing.data, listing.len, encoding, headOnly);
+    free(listing.data);
+    return 200;
+}
+//sets the index file names from a comma separated list
+void setIndexFiles(char *list)
+{
+    char *copy = strdup(list);
+    numIndexFiles = 0;
+    for (char *name = strtok(copy, ","); name != NULL && numIndexFiles < MAX_INDEX_FILES; name = strtok(NULL, ","))
+    {
+        if (*name && strchr(name, '/') == NULL)
+            indexFiles[numIndexFiles++] = name;
+    }
+}
+//finds the index file of a directory, NULL if it has none. the answer, either way, is kept
+//until the directory's mtime shows an entry was added, removed or renamed, so a directory
+//hit costs no failed opens of the names it does not have
+const char *findIndex(const char *dirPath, struct stat *st)
+{
+    struct stat indexSt;
+    unsigned slot = cacheHash(dirPath) % INDEX_CACHE_SIZE;
+    INDEX_ENTRY *e = &indexCache[slot];
 
-        //create path for index.html
-        strcpy(tmp, ".");
-        strcat(tmp, basePath);
-        strcat(tmp, "index.html");
+    lockFiles(slot);
+    if (strcmp(e->path, dirPath) == 0 && e->dev == st->st_dev && e->ino == st->st_ino &&
+        e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec)
+    {
+        int known = e->index;
+        unlockFiles(slot);
+        return known == -1 ? NULL : indexFiles[known];
+    }
 
-        if ((file_fd = open(tmp, O_RDONLY)) == -1)
+    int index = -1;
+    int dirFd = open(dirPath, O_RDONLY | O_DIRECTORY);
+    for (int i = 0; dirFd != -1 && i < numIndexFiles; i++)
+    {
+        if (fstatat(dirFd, indexFiles[i], &indexSt, 0) == 0 && S_ISREG(indexSt.st_mode))
         {
-            //couldnt find index.html
-            //create path for index.htm
-            memset(tmp, 0, strlen(tmp));
-            strcpy(tmp, ".");
-            strcat(tmp, basePath);
-            strcat(tmp, "index.htm");
-
-            if ((file_fd = open(tmp, O_RDONLY)) == -1)
-            {
-                //couldnt find index.htm
-                //create path for default.htm
-                memset(tmp, 0, strlen(tmp));
-                strcpy(tmp, ".");
-                strcat(tmp, basePath);
-                strcat(tmp, "default.htm");
-                //Cant find index.htm
-                if ((file_fd = open(tmp, O_RDONLY)) == -1)
-                {
-                    //Cant find default.htm
-                }
-            }
+            index = i;
+            break;
         }
+    }
+    if (dirFd != -1)
+        close(dirFd);
+    //paths too long for the cache are looked up every time
+    if (strlen(dirPath) < MAX_PATHSIZE)
+    {
+        strcpy(e->path, dirPath);
+        e->dev = st->st_dev;
+        e->ino = st->st_ino;
+        e->mtime = st->st_mtim;
+        e->index = index;
+    }
+    unlockFiles(slot);
+    return index == -1 ? NULL : indexFiles[index];
+}
+//empties every worker's file and index caches, before any worker is forked. the threads of
+//a worker's pool share them
+void fileCacheInit(void)
+{
+    struct rlimit limit;
 
-        //could not open any of the files above. Serve the dir listing
-        //does not differenciate between directory and files
-        //https://stackoverflow.com/questions/12489/how-do-you-get-a-directory-listing-in-c
-        if (file_fd == -1)
-        {
-            writeHeader(sock, 200, "OK", "text/html");
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
+        fileCache[i].fd = -1;
+    for (int i = 0; i < FILE_CACHE_LOCKS; i++)
+        pthread_mutex_init(&fileCacheLocks[i], NULL);
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur / FILE_CACHE_FD_SHARE < FILE_CACHE_SIZE)
+    {
+        maxCachedFds = limit.rlim_cur / FILE_CACHE_FD_SHARE;
+    }
+}
+//locks the slots of the file and index caches that share a lock with slot. only the threads
+//of a pool have anyone to share them with
+void lockFiles(unsigned slot)
+{
+    if (pool != NULL)
+        pthread_mutex_lock(&fileCacheLocks[slot % FILE_CACHE_LOCKS]);
+}
+void unlockFiles(unsigned slot)
+{
+    if (pool != NULL)
+        pthread_mutex_unlock(&fileCacheLocks[slot % FILE_CACHE_LOCKS]);
+}
+//finds what a path is, NULL if it does not exist. the answer, either way, is trusted for
+//fileCacheTtl seconds and then checked with a stat, keeping the descriptor and metadata while
+//the file is unchanged, so a hot file costs no path lookups or opens at all. the cache entry
+//can change as soon as it is unlocked, so its metadata and type are copied into the caller's
+//entry, which is what is returned
+FILE_ENTRY *lookupFile(const char *path, FILE_ENTRY *copy)
+{
+    long start = monotonicNs();
+    unsigned slot = cacheHash(path) % FILE_CACHE_SIZE;
 
-            if (!headOnly)
-            {
+    lockFiles(slot);
+    FILE_ENTRY *e = resolveFile(path, slot, copy);
+    if (e != NULL)
+    {
+        copy->exists = 1;
+        copy->st = e->st;
+        copy->mime = e->mime;
+        copy->fd = -1;
+        copy->map = NULL;
+    }
+    unlockFiles(slot);
+    observeLatency(STAGE_OPEN, monotonicNs() - start);
+    return e != NULL ? copy : NULL;
+}
+//looks up a path in its slot of the file cache, which the caller has locked. a path too long
+//to be kept is looked up in scratch every time, without a descriptor
+FILE_ENTRY *resolveFile(const char *path, unsigned slot, FILE_ENTRY *scratch)
+{
+    struct stat st;
+    time_t now = time(NULL);
+    FILE_ENTRY *e = &fileCache[slot];
+    int known = strcmp(e->path, path) == 0;
 
-                sprintf(buffer, "<!DOCTYPE html>\r\n"
-                                "<html>\r\n"
-                                " <head>\r\n"
-                                "  <meta charset='utf-8'>\r\n"
-                                "  <title>Directory Listing</title>\r\n"
-                                "  <base href='%s'>\r\n"
-                                "  <style>\r\n"
-                                "   td{padding: 0 20px 0 0;}\r\n"
-                                "  </style>\r\n"                                
-                                " </head>\r\n"
-                                " <body>\r\n"
-                                "  <h1>Directory listing for %s</h1>\r\n"
-                                "  <table>\r\n",
-                        basePath, rpath);
-
-                write(sock, buffer, strlen(buffer));
-                DIR *dir;
-                struct dirent *dirListing;
-                //we're already in the current directory
-                dir = opendir(rpath);
-
-                if (dir != NULL)
-                {
-                    int hasFiles = 0;
-                    while (dirListing = readdir(dir))
-                    {
-                        //skip the . and .. listings
-                        if(!strcmp(dirListing->d_name, ".") || !strcmp(dirListing->d_name, "..")){
-                            continue;
-                        }
-                        //reset the tmp string
-                        //create a string containing the relative path for each directory file
-                        memset(tmp, 0, strlen(tmp));
-                        strcpy(tmp, ".");
-                        strcat(tmp, basePath);
-                        strcat(tmp, dirListing->d_name);
-                        
-                        //open the file and stat it to get details 
-                        if ((file_fd = open(tmp, O_RDONLY)) == -1){
-                            perror(dirListing->d_name);
-                            continue;
-                        }
-                        fstat(file_fd, &statbuf);
-                        
-                        //display the time                        
-                        strftime(m_time, sizeof(m_time),
-                                 "%Y-%m-%d %H:%M", localtime(&statbuf.st_mtime));
-
-                        //if the file is a file or a directory
-                        if(S_ISREG(statbuf.st_mode) || S_ISDIR(statbuf.st_mode)){
-                            //append a / if its a directory
-                            char *d = S_ISDIR(statbuf.st_mode) ? "/" : "";
-                            //get the size of the file uisng the mentioned readable_fs function 
-                            char size[15];
-                            sprintf(size, "%s", readable_fs(statbuf.st_size, buffer));
-                            //no need to get the size if its a directory
-                            if(S_ISDIR(statbuf.st_mode))
-                            {
-                                sprintf(size,"[DIR]");
-                            } 
-                            //has files to check if there are no files
-                            hasFiles++;
-                            //serve it as a table
-                            sprintf(buffer, "   <tr><td><a href=\"%s\">%s%s</a></td><td>%s</td><td>%s</td></tr>\r\n",
-                            dirListing->d_name, dirListing->d_name, d, m_time, size);
-                            write(sock, buffer, strlen(buffer));
-                        }
-                        // char *d = S_ISDIR(statbuf.st_mode) ? "/" : "";
+    if (strlen(path) >= MAX_PATHSIZE)
+    {
+        e = scratch;
+        e->fd = -1;
+        e->map = NULL;
+        known = 0;
+    }
+    if (known && now - e->checked < fileCacheTtl)
+        return e->exists ? e : NULL;
 
-                        // sprintf(buffer, "   <li><a href=\"%s\">%s%s</a></li>\r\n", dirListing->d_name, dirListing->d_name, d);
-                        // write(sock, buffer, strlen(buffer));
-                    }
-                    //no files, just serve a blank table
-                    if(!hasFiles)
-                    {
-                        sprintf(buffer, "   <tr><td>No files found</td></tr>\r\n");
-                        write(sock, buffer, strlen(buffer));
-                    }
-                    sprintf(buffer, "  </table>\r\n"
-                                    " </body>\r\n"
-                                    "</html>\r\n");
-                    write(sock, buffer, strlen(buffer));
-                    writelogStatus(method, host, resource, 200);
-                    closedir(dir);
-                }
-                else
-                {
-                    perror("Couldn't open the directory");
-                }
-            }
-            writelogStatus(method, host, resource, 200);
+    int exists = stat(path, &st) == 0;
+    e->checked = now;
+    if (known && exists && e->exists && e->st.st_dev == st.st_dev && e->st.st_ino == st.st_ino &&
+        e->st.st_size == st.st_size && e->st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+        e->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        return e;
+    }
+    //new, replaced or changed, whatever was open belongs to the old file
+    closeCachedFd(e);
+    releaseMapping(e->map);
+    e->map = NULL;
+    e->exists = exists;
+    e->mime = NULL;
+    if (e != scratch)
+        strcpy(e->path, path);
+    if (!exists)
+        return NULL;
+    //the metadata is taken from the descriptor so the two always agree. one is only kept while
+    //the cache holds fewer than its share of the descriptor limit
+    if (S_ISREG(st.st_mode) && e != scratch && atomic_load(&cachedFds) < maxCachedFds &&
+        (e->fd = open(path, O_RDONLY)) != -1)
+    {
+        atomic_fetch_add(&cachedFds, 1);
+        fstat(e->fd, &st);
+    }
+    e->st = st;
+    const char *ext = strrchr(path, '.');
+    if (S_ISREG(st.st_mode) && ext != NULL)
+        e->mime = findMime(ext + 1);
+    return e;
+}
+//returns the shared mapping of a file with a reference taken for the caller, mapping it the
+//first time. it is read ahead sequentially and in huge pages where the file system can back
+//them. NULL if the file cannot be mapped
+MAPPING *mapFile(const char *path)
+{
+    FILE_ENTRY scratch;
+    unsigned slot = cacheHash(path) % FILE_CACHE_SIZE;
+    MAPPING *map = NULL;
+
+    lockFiles(slot);
+    FILE_ENTRY *e = resolveFile(path, slot, &scratch);
+    if (e == NULL || e->st.st_size == 0 || (e->map == NULL && e->fd == -1))
+    {
+        unlockFiles(slot);
+        return NULL;
+    }
+    if (e->map == NULL)
+    {
+        if ((map = malloc(sizeof(MAPPING))) == NULL)
+        {
+            unlockFiles(slot);
+            return NULL;
         }
-        else
+        map->len = e->st.st_size;
+        map->addr = mmap(NULL, map->len, PROT_READ, MAP_SHARED, e->fd, 0);
+        if (map->addr == MAP_FAILED)
         {
-            //we know the above files will be html
-            writeHeader(sock, 200, "OK", "text/html");
+            unlockFiles(slot);
+            free(map);
+            return NULL;
+        }
+        atomic_init(&map->refs, 1);
+        posix_fadvise(e->fd, 0, map->len, POSIX_FADV_SEQUENTIAL);
+        madvise(map->addr, map->len, MADV_SEQUENTIAL);
+        if (map->len >= HUGE_PAGE_SIZE)
+            madvise(map->addr, map->len, MADV_HUGEPAGE);
+        e->map = map;
+    }
+    map = e->map;
+    atomic_fetch_add(&map->refs, 1);
+    unlockFiles(slot);
+    return map;
+}
+//drops a reference to a mapping, unmapping it with the last one
+void releaseMapping(MAPPING *map)
+{
+    if (map != NULL && atomic_fetch_sub(&map->refs, 1) == 1)
+    {
+        munmap(map->addr, map->len);
+        free(map);
+    }
+}
+//opens a file for a response, which owns the descriptor it gets and closes it once sent.
+//a cached descriptor is duplicated, sharing its file offset, so files are only ever read at
+//an explicit offset. returns -1 if the file cannot be opened
+int openFile(const char *path, struct stat *st)
+{
+    FILE_ENTRY scratch;
+    long start = monotonicNs();
+    unsigned slot = cacheHash(path) % FILE_CACHE_SIZE;
+    int fd = -1;
 
-            if (!headOnly)
+    //the cached descriptor is duplicated under the lock, another thread may close it after
+    lockFiles(slot);
+    FILE_ENTRY *e = resolveFile(path, slot, &scratch);
+    int regular = e != NULL && S_ISREG(e->st.st_mode);
+    if (regular && e->fd != -1 && (fd = dup(e->fd)) != -1)
+        *st = e->st;
+    unlockFiles(slot);
+    observeLatency(STAGE_OPEN, monotonicNs() - start);
+    if (!regular || fd != -1)
+        return fd;
+    if ((fd = open(path, O_RDONLY)) == -1 && (errno == EMFILE || errno == ENFILE))
+    {
+        //out of descriptors, give back the ones the cache is keeping and try again
+        dropCachedFds();
+        fd = open(path, O_RDONLY);
+    }
+    if (fd != -1)
+        fstat(fd, st);
+    return fd;
+}
+//closes the descriptor a file cache entry keeps, if it has one
+void closeCachedFd(FILE_ENTRY *e)
+{
+    if (e->fd == -1)
+        return;
+    close(e->fd);
+    e->fd = -1;
+    atomic_fetch_sub(&cachedFds, 1);
+}
+//closes every descriptor the file cache keeps, for when the process has run out of them. the
+//metadata stays, the files are opened for each response until they are checked again
+void dropCachedFds(void)
+{
+    for (int lock = 0; lock < FILE_CACHE_LOCKS; lock++)
+    {
+        lockFiles(lock);
+        for (int i = lock; i < FILE_CACHE_SIZE; i += FILE_CACHE_LOCKS)
+            closeCachedFd(&fileCache[i]);
+        unlockFiles(lock);
+    }
+}
+//forgets the paths that have gone unrequested for longer than they are trusted, closing their
+//descriptors and mappings, so files no longer requested are not held open. runs at most once
+//a second
+void expireFiles(void)
+{
+    static time_t lastSweep = 0;
+    time_t now = time(NULL);
+
+    if (now == lastSweep)
+        return;
+    lastSweep = now;
+    for (int lock = 0; lock < FILE_CACHE_LOCKS; lock++)
+    {
+        lockFiles(lock);
+        for (int i = lock; i < FILE_CACHE_SIZE; i += FILE_CACHE_LOCKS)
+        {
+            FILE_ENTRY *e = &fileCache[i];
+            if (e->path[0] != 0 && now - e->checked > fileCacheTtl)
             {
-                while ((n = read(file_fd, buffer, BUFF_SIZE)) > 0)
-                {
-                    write(sock, buffer, n);
-                }
-                writelogStatus(method, host, resource, 200);
+                closeCachedFd(e);
+                releaseMapping(e->map);
+                e->map = NULL;
+                e->path[0] = 0;
             }
         }
-        // }
+        unlockFiles(lock);
+    }
+}
+//processes the directory request: its index file if it has one, otherwise its listing
+void processDirectory(CONNECTION *conn, char *resource, char *rpath, char *query, char *host, int headOnly, struct stat *st)
+{
+    //check for directory requests
+    char *method = (headOnly) ? "HEAD" : "GET";
+    //the base path and directory path end in a slash, entries are relative to them
+    char *basePath = arenaAlloc(&conn->arena, strlen(resource) + 2);
+    char *dirPath = arenaAlloc(&conn->arena, strlen(rpath) + 2);
+    if (basePath == NULL || dirPath == NULL)
+    {
+        serveErr(conn, headOnly, 500, "Internal Server Error", "The server encountered an internal error");
+        writelogStatus(method, host, resource, 500);
+        return;
+    }
+    char *slash = resource[strlen(resource) - 1] != '/' ? "/" : "";
+    sprintf(basePath, "%s%s", resource, slash);
+    sprintf(dirPath, "%s%s", rpath, rpath[strlen(rpath) - 1] != '/' ? "/" : "");
+
+    //check for parent directory requests.
+    if (strstr(dirPath, "..") != NULL)
+    {
+        //cannot process parent directory from root requets
+        serveErr(conn, headOnly, 400, "Bad Request", "The server could not process the request");
+
+        writelogStatus(method, host, resource, 400);
+        return;
+    }
+
+    //the index file is served like any other file, with its validators, ranges and codings
+    const char *index = findIndex(dirPath, st);
+    char *indexResource = NULL, *indexPath = NULL;
+    if (index != NULL && (indexResource = arenaAlloc(&conn->arena, strlen(basePath) + strlen(index) + 1)) != NULL &&
+        (indexPath = arenaAlloc(&conn->arena, strlen(dirPath) + strlen(index) + 1)) != NULL)
+    {
+        sprintf(indexResource, "%s%s", basePath, index);
+        sprintf(indexPath, "%s%s", dirPath, index);
+        FILE_ENTRY indexEntry;
+        FILE_ENTRY *indexFile = lookupFile(indexPath, &indexEntry);
+        if (indexFile != NULL && S_ISREG(indexFile->st.st_mode))
+        {
+            processFile(conn, indexResource, indexPath, host, headOnly, indexFile);
+            return;
+        }
     }
-    free(tmp);
-    free(basePath);
-    free(rpath);
+    int status = serveListing(conn, dirPath, basePath, query, headOnly);
+    writelogStatus(method, host, resource, status);
 }
 //echos back a user request
-void trace(int sock, char *resource, char *host, char *echo)
+void trace(CONNECTION *conn, char *resource, char *host, char *echo, int len)
 {
-    char buffer[BUFF_SIZE];
-    writeHeader(sock, 200, "OK", "message/http");
+    writeHeader(conn, 200, "OK", "message/http", len);
 
     //send the request back in the response
-    sprintf(buffer, "%s", echo);
-    write(sock, buffer, strlen(buffer));
+    appendOutput(conn, echo, len);
     writelogStatus("TRACE", host, resource, 200);
 }
 
 //Catches and handles pid that may become zombies
 
+#ifdef PROFILE_BUILD
+//profile guided builds exit normally on SIGTERM, which is when a training run writes its profile
+void catch (int signo)
+{
+    (void)signo;
+    exit(0);
+}
+#endif
 void claim_zombie()
 {
     pid_t pid = 1;
@@ -795,6 +4893,13 @@ void claim_zombie()
     }
 }
 
+//asks the worker to log the cache counters once it is safe to do so
+void request_stats(int signo)
+{
+    (void)signo;
+    statsRequested = 1;
+}
+
 //Turn server code into a daemon
 
 int daemon_init(void)
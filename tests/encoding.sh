@@ -0,0 +1,67 @@
+#!/bin/sh
+# content coding negotiation on each engine: the coding picked for an Accept-Encoding with
+# q-values, Vary on every response that could have been coded, bodies that decode to the file
+# and identity where nothing acceptable is left, the file is too small to gain from coding or
+# its type is not compressible. run from the top of the tree after make
+# usage: tests/encoding.sh [server binary]
+set -e
+server=${1:-./myhttpd}
+root=$(mktemp -d)
+out=$(mktemp)
+status=0
+runs=0
+
+seq 1 20000 > "$root/data.txt"
+printf 'small\n' > "$root/small.txt"
+head -c 20000 /dev/urandom > "$root/photo.jpg"
+
+# compares what was got with what was wanted and remembers a mismatch
+expect()
+{
+    if [ "$2" = "$3" ]; then
+        echo "  $1: $2"
+    else
+        echo "  $1: got $2, wanted $3"
+        status=1
+    fi
+}
+
+# the Content-Encoding and Vary of a response to Accept-Encoding $2, - where there is none
+coding()
+{
+    curl -s -o /dev/null -D - ${2:+-H "Accept-Encoding: $2"} "$url/$1" | tr -d '\r' |
+        awk -F': ' 'tolower($1) == "content-encoding" { e = $2 } tolower($1) == "vary" { v = $2 }
+                    END { printf "%s %s", e ? e : "-", v ? v : "-" }'
+}
+
+for mode in "" -e -u; do
+    runs=$((runs + 1))
+    port=$((20000 + ($$ + runs * 97) % 20000))
+    "$server" -p $port -l "$root/log" -d "$root" -m "$(pwd)/mime.types" -f 1 $mode > "$out"
+    pid=$(sed -n 's/^Server pid = \([0-9]*\).*/\1/p' "$out")
+    sleep 1
+    url=http://127.0.0.1:$port
+    echo "encoding${mode:+ with $mode}:"
+
+    expect "no Accept-Encoding" "$(coding data.txt)" "- Accept-Encoding"
+    expect "gzip" "$(coding data.txt gzip)" "gzip Accept-Encoding"
+    expect "deflate" "$(coding data.txt deflate)" "deflate Accept-Encoding"
+    expect "all three" "$(coding data.txt 'gzip, deflate, br')" "br Accept-Encoding"
+    expect "br refused with q=0" "$(coding data.txt 'gzip;q=0.5, br;q=0')" "gzip Accept-Encoding"
+    expect "only deflate weighted" "$(coding data.txt 'br;q=0, gzip;q=0.000, deflate;q=0.1')" \
+        "deflate Accept-Encoding"
+    expect "any" "$(coding data.txt '*')" "br Accept-Encoding"
+    expect "any refused" "$(coding data.txt '*;q=0')" "- Accept-Encoding"
+    expect "identity only" "$(coding data.txt identity)" "- Accept-Encoding"
+    expect "too small to code" "$(coding small.txt gzip)" "- Accept-Encoding"
+    expect "not compressible" "$(coding photo.jpg gzip)" "- -"
+    for c in gzip deflate br; do
+        curl -s --compressed -H "Accept-Encoding: $c" "$url/data.txt" > "$out.body"
+        expect "$c body" "$(cmp -s "$out.body" "$root/data.txt" && echo decodes || echo differs)" decodes
+    done
+
+    kill -TERM -"$pid" 2>/dev/null || true
+    sleep 1
+done
+rm -rf "$root" "$out" "$out.body"
+exit $status
@@ -0,0 +1,33 @@
+#!/bin/sh
+# a directory requested through a path as long as a request can carry must be listed, or
+# refused, without taking the worker down. run from the top of the tree after make
+# usage: tests/long-path.sh [server binary]
+set -e
+server=${1:-./myhttpd}
+log=$(mktemp)
+out=$(mktemp)
+status=0
+runs=0
+
+for mode in "" -e -u; do
+    # a fresh port per server, the last one's connections may still hold its port
+    runs=$((runs + 1))
+    port=$((20000 + ($$ + runs * 97) % 20000))
+    "$server" -p $port -l "$log" -d "$(pwd)" -m mime.types -f 1 $mode > "$out"
+    pid=$(sed -n 's/^Server pid = \([0-9]*\).*/\1/p' "$out")
+    sleep 1
+    # /test followed by thousands of slashes, far more than a path ever needs
+    slashes=$(printf '%3000s' | tr ' ' /)
+    code=$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$port/test$slashes" || true)
+    after=$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$port/test/" || true)
+    case "$code" in
+    200 | 414) ;;
+    *) status=1 ;;
+    esac
+    [ "$after" = 200 ] || status=1
+    echo "long path${mode:+ with $mode}: $code, then $after"
+    kill -TERM -"$pid" 2>/dev/null || true
+    sleep 1
+done
+rm -f "$log" "$out"
+exit $status
@@ -0,0 +1,72 @@
+#!/bin/sh
+# pipelined requests on each engine. GET and HEAD requests sent in one write must be answered
+# in order, HEAD without a body, and a Connection: close part way through the batch must be the
+# last one answered before the connection closes. run from the top of the tree after make
+# usage: tests/pipelining.sh [server binary]
+set -e
+server=${1:-./myhttpd}
+root=$(mktemp -d)
+out=$(mktemp)
+status=0
+runs=0
+
+printf 'alpha\n' > "$root/a.txt"
+printf 'bravo, a longer one\n' > "$root/b.txt"
+
+for mode in "" -e -u "-t 2"; do
+    runs=$((runs + 1))
+    port=$((20000 + ($$ + runs * 97) % 20000))
+    "$server" -p $port -l "$root/log" -d "$root" -m "$(pwd)/mime.types" -f 1 $mode > "$out"
+    pid=$(sed -n 's/^Server pid = \([0-9]*\).*/\1/p' "$out")
+    sleep 1
+
+    # every response as method, status and body, in the order they came, then how it ended
+    got=$(python3 - "$port" <<'EOF'
+import socket, sys
+
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.settimeout(5)
+batch = [("GET", "/a.txt", ""), ("HEAD", "/b.txt", ""), ("GET", "/b.txt", ""),
+         ("GET", "/a.txt", "Connection: close\r\n"), ("GET", "/b.txt", "")]
+s.sendall(b"".join(("%s %s HTTP/1.1\r\nHost: test\r\n%s\r\n" % r).encode() for r in batch))
+data = b""
+try:
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    end = "closed"
+except socket.timeout:
+    end = "left open"
+answers = []
+for method, _, _ in batch:
+    if b"\r\n\r\n" not in data:
+        break
+    head, data = data.split(b"\r\n\r\n", 1)
+    lines = head.decode().split("\r\n")
+    length = 0
+    for line in lines[1:]:
+        if line.lower().startswith("content-length:"):
+            length = int(line.split(":")[1])
+    body = b"" if method == "HEAD" else data[:length]
+    data = data[len(body):]
+    answers.append("%s %s %s" % (method, lines[0].split()[1], body.decode().strip() or "-"))
+if data:
+    end = "%d stray bytes, %s" % (len(data), end)
+print("; ".join(answers + [end]))
+EOF
+)
+    want="GET 200 alpha; HEAD 200 -; GET 200 bravo, a longer one; GET 200 alpha; closed"
+    if [ "$got" = "$want" ]; then
+        echo "pipelining${mode:+ with $mode}: $got"
+    else
+        echo "pipelining${mode:+ with $mode}: got $got, wanted $want"
+        status=1
+    fi
+
+    kill -TERM -"$pid" 2>/dev/null || true
+    sleep 1
+done
+rm -rf "$root" "$out"
+exit $status
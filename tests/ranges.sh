@@ -0,0 +1,69 @@
+#!/bin/sh
+# byte ranges and conditional requests on each engine: single, suffix and multiple ranges,
+# an unsatisfiable range, If-None-Match and If-Modified-Since answered with 304 and If-Range
+# deciding between the range and the whole file. run from the top of the tree after make
+# usage: tests/ranges.sh [server binary]
+set -e
+server=${1:-./myhttpd}
+root=$(mktemp -d)
+out=$(mktemp)
+status=0
+runs=0
+
+# a numbered line per row, so any range of it is easy to check
+seq 1 20000 > "$root/data.txt"
+size=$(wc -c < "$root/data.txt")
+
+# compares what was got with what was wanted and remembers a mismatch
+expect()
+{
+    if [ "$2" = "$3" ]; then
+        echo "  $1: $2"
+    else
+        echo "  $1: got $2, wanted $3"
+        status=1
+    fi
+}
+
+for mode in "" -e -u; do
+    runs=$((runs + 1))
+    port=$((20000 + ($$ + runs * 97) % 20000))
+    "$server" -p $port -l "$root/log" -d "$root" -m "$(pwd)/mime.types" -f 1 $mode > "$out"
+    pid=$(sed -n 's/^Server pid = \([0-9]*\).*/\1/p' "$out")
+    sleep 1
+    url=http://127.0.0.1:$port/data.txt
+    echo "ranges${mode:+ with $mode}:"
+
+    expect "single range" "$(curl -s -r 0-9 -w ' %{http_code}' "$url" | tr '\n' ' ')" "1 2 3 4 5  206"
+    expect "content range" "$(curl -s -o /dev/null -D - -r 10-19 "$url" | tr -d '\r' | sed -n 's/^Content-Range: //p')" \
+        "bytes 10-19/$size"
+    expect "suffix range" "$(curl -s -r -6 -w ' %{http_code}' "$url" | tr '\n' ' ')" "20000  206"
+    expect "open range" "$(curl -s -r $((size - 6))- -w ' %{http_code}' "$url" | tr '\n' ' ')" "20000  206"
+    # every part carries its own Content-Range and the parts come in the order asked for
+    curl -s -D "$out.head" -r 0-3,10-13 "$url" | tr -d '\r' > "$out.body"
+    expect "multiple ranges" "$(tr -d '\r' < "$out.head" | sed -n 's/^Content-Type: \([^;]*\);.*/\1/p')" \
+        "multipart/byteranges"
+    expect "parts" "$(sed -n 's/^Content-Range: //p' "$out.body" | tr '\n' ' ')" \
+        "bytes 0-3/$size bytes 10-13/$size "
+    expect "unsatisfiable range" "$(curl -s -o /dev/null -w '%{http_code}' -r $((size + 10))-$((size + 20)) "$url")" 416
+
+    curl -s -o /dev/null -D "$out.head" "$url"
+    etag=$(tr -d '\r' < "$out.head" | sed -n 's/^ETag: //p')
+    modified=$(tr -d '\r' < "$out.head" | sed -n 's/^Last-Modified: //p')
+    expect "If-None-Match" "$(curl -s -o /dev/null -w '%{http_code}' -H "If-None-Match: $etag" "$url")" 304
+    expect "If-None-Match, another tag" "$(curl -s -o /dev/null -w '%{http_code}' -H 'If-None-Match: "other"' "$url")" 200
+    expect "If-Modified-Since" "$(curl -s -o /dev/null -w '%{http_code}' -H "If-Modified-Since: $modified" "$url")" 304
+    expect "If-Modified-Since, older" \
+        "$(curl -s -o /dev/null -w '%{http_code}' -H 'If-Modified-Since: Thu, 01 Jan 2015 00:00:00 GMT' "$url")" 200
+    expect "If-Range, current tag" \
+        "$(curl -s -o /dev/null -w '%{http_code} %{size_download}' -r 0-9 -H "If-Range: $etag" "$url")" "206 10"
+    expect "If-Range, stale tag" \
+        "$(curl -s -o /dev/null -w '%{http_code} %{size_download}' -r 0-9 -H 'If-Range: "stale"' "$url")" "200 $size"
+    expect "If-Range, current date" \
+        "$(curl -s -o /dev/null -w '%{http_code} %{size_download}' -r 0-9 -H "If-Range: $modified" "$url")" "206 10"
+
+    kill -TERM -"$pid" 2>/dev/null || true
+    sleep 1
+done
+rm -rf "$root" "$out" "$out.head" "$out.body"
+exit $status
@@ -0,0 +1,104 @@
+#!/bin/sh
+# header, idle and send timeouts on each engine. with every timeout at 2 s, a persistent
+# connection left idle after a request, one that drips its header and one that stops reading a
+# large body must each be closed within a few seconds, and counted as such. run from the top
+# of the tree after make
+# usage: tests/timeouts.sh [server binary]
+set -e
+server=${1:-./myhttpd}
+root=$(mktemp -d)
+out=$(mktemp)
+status=0
+runs=0
+
+head -c 20000000 /dev/zero | tr '\0' x > "$root/large.txt"
+
+# compares what was got with what was wanted and remembers a mismatch
+expect()
+{
+    if [ "$2" = "$3" ]; then
+        echo "  $1: $2"
+    else
+        echo "  $1: got $2, wanted $3"
+        status=1
+    fi
+}
+
+# runs one slow client against the server and says how the server dealt with it
+slow()
+{
+    python3 - "$port" "$1" <<'EOF'
+import socket, sys, time
+
+port, kind = int(sys.argv[1]), sys.argv[2]
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+s.connect(("127.0.0.1", port))
+start = time.time()
+if kind == "idle":
+    # one request is answered, then nothing more is sent
+    s.send(b"HEAD /large.txt HTTP/1.1\r\nHost: test\r\n\r\n")
+    s.settimeout(8)
+    response = b""
+    while b"\r\n\r\n" not in response:
+        response += s.recv(4096)
+    start = time.time()
+    closed = s.recv(1) == b""
+elif kind == "header":
+    # the header keeps coming, a line every half second, but is never finished
+    s.send(b"GET /large.txt HTTP/1.1\r\n")
+    s.settimeout(0.5)
+    closed = False
+    while not closed and time.time() - start < 8:
+        try:
+            s.send(b"X-Slow: yes\r\n")
+            closed = s.recv(1) == b""
+        except socket.timeout:
+            pass
+        except OSError:
+            closed = True
+else:
+    # the response is never read, then what made it out is drained
+    s.send(b"GET /large.txt HTTP/1.1\r\nHost: test\r\n\r\n")
+    time.sleep(6)
+    s.settimeout(2)
+    got = 0
+    try:
+        while True:
+            n = len(s.recv(65536))
+            if n == 0:
+                break
+            got += n
+    except (socket.timeout, OSError):
+        pass
+    closed = got < 20000000
+if not closed:
+    print("kept open")
+elif kind != "send" and not 1 <= time.time() - start <= 4:
+    print("closed after %.1f s" % (time.time() - start))
+else:
+    print("closed")
+EOF
+}
+
+for mode in "" -e -u "-t 2"; do
+    runs=$((runs + 1))
+    port=$((20000 + ($$ + runs * 97) % 20000))
+    "$server" -p $port -l "$root/log" -d "$root" -m "$(pwd)/mime.types" -f 1 -k 2 -h 2 -g 2 $mode > "$out"
+    pid=$(sed -n 's/^Server pid = \([0-9]*\).*/\1/p' "$out")
+    sleep 1
+    echo "timeouts${mode:+ with $mode}:"
+
+    expect "idle" "$(slow idle)" closed
+    expect "header" "$(slow header)" closed
+    expect "send" "$(slow send)" closed
+    curl -s "http://127.0.0.1:$port/__metrics" > "$out.metrics"
+    for kind in idle header send; do
+        expect "$kind counted" "$(sed -n "s/^myhttpd_timeouts_total{kind=\"$kind\"} \([1-9]\).*/yes/p" "$out.metrics")" yes
+    done
+
+    kill -TERM -"$pid" 2>/dev/null || true
+    sleep 1
+done
+rm -rf "$root" "$out" "$out.metrics"
+exit $status
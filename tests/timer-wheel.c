@@ -0,0 +1,111 @@
+//checks that the timer wheel expires connections on the second their timeout runs out, never
+//before, including timers that start on an upper level and have to cascade down to level 0.
+//the server is compiled in with its main renamed so the real wheel is tested
+#define main myhttpd_main
+#include "../myhttpd.c"
+#undef main
+
+//the timeouts, in seconds, of a connection idle between requests, reading a request header and
+//sending a response
+#define IDLE_TIMEOUT 100
+#define HEADER_TIMEOUT 5000
+#define SEND_TIMEOUT 300000
+
+//one connection for each level of the wheel: what it is doing, how long it has been at it
+//and when its timeout runs out, in seconds from the start
+typedef struct
+{
+    const char *name;
+    int state;
+    int reading;
+    int waited;
+    int seconds;
+} WAITING;
+
+WAITING waiting[] = {
+    {"idle, nearly out", CONN_READING, 0, IDLE_TIMEOUT - 3, 3},
+    {"idle", CONN_READING, 0, 0, IDLE_TIMEOUT},
+    {"header", CONN_READING, 1, 0, HEADER_TIMEOUT},
+    {"send", CONN_SENDING_BODY, 0, 0, SEND_TIMEOUT},
+};
+#define NUM_WAITING (int)(sizeof(waiting) / sizeof(waiting[0]))
+
+//sets a connection up as having done what it is waiting on since w->waited seconds before start
+void startWaiting(CONNECTION *conn, WAITING *w, unsigned long start)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->state = w->state;
+    conn->lastActive = start - w->waited;
+    if (w->reading)
+        conn->requestStart = start - w->waited;
+}
+
+//runs the wheel a tick at a time, or in jumps of step ticks, from start until every connection
+//has expired and checks each one came out exactly when it was due. returns the failures
+int runWheel(unsigned long start, unsigned long step)
+{
+    TIMER_WHEEL wheel;
+    TIMER expired;
+    CONNECTION conns[NUM_WAITING];
+    unsigned long due[NUM_WAITING];
+    int done[NUM_WAITING] = {0};
+    int failures = 0, left = NUM_WAITING;
+
+    timerInit(&wheel);
+    wheel.now = start;
+    for (int i = 0; i < NUM_WAITING; i++)
+    {
+        startWaiting(&conns[i], &waiting[i], start);
+        armTimeout(&wheel, &conns[i]);
+        due[i] = start + waiting[i].seconds;
+    }
+    for (unsigned long now = start; left > 0 && now <= start + SEND_TIMEOUT + 1000; now += step)
+    {
+        timerAdvance(&wheel, now, &expired);
+        while (expired.next != &expired)
+        {
+            CONNECTION *conn = (CONNECTION *)((char *)expired.next - offsetof(CONNECTION, timer));
+            int i = conn - conns;
+            timerCancel(&conn->timer);
+            //a jump may pass the second it was due, but must not end before it
+            if (now < due[i] || now >= due[i] + step)
+            {
+                printf("start %lu, step %lu: %s timeout due at +%lu expired at +%lu\n", start, step,
+                       waiting[i].name, due[i] - start, now - start);
+                failures++;
+            }
+            done[i] = 1;
+            left--;
+        }
+    }
+    for (int i = 0; i < NUM_WAITING; i++)
+    {
+        if (!done[i])
+        {
+            printf("start %lu, step %lu: %s timeout due at +%lu never expired\n", start, step,
+                   waiting[i].name, due[i] - start);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main(void)
+{
+    //starts just before the wheel comes round on each level, so the timers cascade through a
+    //rollover of every level on their way down
+    unsigned long starts[] = {1000, TIMER_SLOTS * TIMER_SLOTS - 10, TIMER_SLOTS * TIMER_SLOTS * TIMER_SLOTS - 5};
+    unsigned long steps[] = {1, 7};
+    int failures = 0;
+
+    keepAliveTimeout = IDLE_TIMEOUT;
+    headerTimeout = HEADER_TIMEOUT;
+    sendTimeout = SEND_TIMEOUT;
+    for (size_t i = 0; i < sizeof(starts) / sizeof(starts[0]); i++)
+    {
+        for (size_t j = 0; j < sizeof(steps) / sizeof(steps[0]); j++)
+            failures += runWheel(starts[i], steps[j]);
+    }
+    printf("timer wheel: %s\n", failures ? "FAILED" : "every timeout expired when due");
+    return failures ? 1 : 0;
+}